@@ -28,6 +28,7 @@ static enum conflate_mgmt_cb_result process_serverlist(void *opaque,
         if (priv && strcmp(priv, "yes") == 0) {
             handle->conf->log(handle->conf->userdata, LOG_LVL_INFO,
                               "Currently using a private config, ignoring update.");
+            free(priv);
             return RV_OK;
         }
         free(priv);
@@ -36,15 +37,14 @@ static enum conflate_mgmt_cb_result process_serverlist(void *opaque,
     handle->conf->log(handle->conf->userdata, LOG_LVL_INFO,
                       "Processing a serverlist");
 
-    /* Persist the config lists */
-    if (!save_kvpairs(handle, conf, handle->conf->save_path)) {
-        handle->conf->log(handle->conf->userdata, LOG_LVL_ERROR,
-                          "Can not save config to %s",
-                          handle->conf->save_path);
+    /* Send the config to the callback, and persist the config lists
+       if it took them */
+    cb_mutex_enter(&handle->callback_lock);
+    if (handle->conf->new_config(handle->conf->userdata, conf) ==
+        CONFLATE_SUCCESS) {
+        accept_config(handle, conf);
     }
-
-    /* Send the config to the callback */
-    handle->conf->new_config(handle->conf->userdata, conf);
+    cb_mutex_exit(&handle->callback_lock);
 
     return RV_OK;
 }
@@ -0,0 +1,152 @@
+/*
+ * The current config of a handle, for threads that want to read it
+ * without a lock or a copy (conflate_config_t.keep_current_config).
+ *
+ * Publishing swaps in a new snapshot and retires the old one with the
+ * epoch it was replaced in.  Readers announce the epoch they started
+ * reading in; a retired snapshot is released once every active reader
+ * started after it was replaced, since only those that started before
+ * could have loaded it.
+ *
+ * Publishing and reader registration take slot_lock.  Reading takes
+ * no lock: an epoch store and a pointer load, separated by a full
+ * barrier that pairs with the one after the publisher's swap.
+ */
+#include <assert.h>
+#include <stdlib.h>
+
+#include "conflate.h"
+#include "conflate_internal.h"
+
+#ifdef WIN32
+#define memory_barrier() MemoryBarrier()
+#else
+#define memory_barrier() __sync_synchronize()
+#endif
+
+struct conflate_reader {
+    conflate_handle_t *handle;
+    volatile unsigned long epoch; /* Zero when not reading. */
+    bool in_use;
+    struct conflate_reader *next;
+};
+
+struct retired_config {
+    kvpair_t *config;
+    unsigned long epoch;
+    struct retired_config *next;
+};
+
+void init_config_slot(conflate_handle_t *handle) {
+    cb_mutex_initialize(&handle->slot_lock);
+    handle->current_config = NULL;
+    /* Reader epochs of zero mean idle, so start counting at one. */
+    handle->config_epoch = 1;
+    handle->readers = NULL;
+    handle->retired = NULL;
+}
+
+/* Release the retired configs no active reader can still be using. */
+static void reclaim_configs(conflate_handle_t *handle) {
+    unsigned long oldest = handle->config_epoch;
+    struct conflate_reader *reader;
+    struct retired_config **pp = &handle->retired;
+
+    for (reader = handle->readers; reader; reader = reader->next) {
+        unsigned long epoch = reader->epoch;
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+
+    while (*pp) {
+        struct retired_config *r = *pp;
+        if (r->epoch < oldest) {
+            *pp = r->next;
+            kvpair_release(r->config);
+            free(r);
+        } else {
+            pp = &r->next;
+        }
+    }
+}
+
+void publish_config(conflate_handle_t *handle, kvpair_t *kv) {
+    kvpair_t *snapshot = kvpair_retain(kv);
+    kvpair_t *old;
+
+    cb_mutex_enter(&handle->slot_lock);
+
+    old = handle->current_config;
+    handle->current_config = snapshot;
+    memory_barrier();
+
+    if (old != NULL) {
+        struct retired_config *r = malloc(sizeof(struct retired_config));
+        assert(r);
+        r->config = old;
+        r->epoch = handle->config_epoch;
+        r->next = handle->retired;
+        handle->retired = r;
+    }
+    handle->config_epoch++;
+    memory_barrier();
+
+    reclaim_configs(handle);
+
+    cb_mutex_exit(&handle->slot_lock);
+}
+
+conflate_reader_t *conflate_register_reader(conflate_handle_t *handle) {
+    conflate_reader_t *reader;
+
+    assert(handle->conf->keep_current_config);
+
+    cb_mutex_enter(&handle->slot_lock);
+    for (reader = handle->readers; reader; reader = reader->next) {
+        if (!reader->in_use) {
+            break;
+        }
+    }
+    if (reader == NULL) {
+        reader = calloc(1, sizeof(conflate_reader_t));
+        assert(reader);
+        reader->handle = handle;
+        reader->next = handle->readers;
+        handle->readers = reader;
+    }
+    reader->in_use = true;
+    reader->epoch = 0;
+    cb_mutex_exit(&handle->slot_lock);
+
+    return reader;
+}
+
+void conflate_unregister_reader(conflate_reader_t *reader) {
+    conflate_handle_t *handle;
+
+    if (reader == NULL) {
+        return;
+    }
+
+    /* Readers are recycled rather than freed, as publish_config() may
+       be walking the list. */
+    handle = reader->handle;
+    cb_mutex_enter(&handle->slot_lock);
+    reader->epoch = 0;
+    reader->in_use = false;
+    cb_mutex_exit(&handle->slot_lock);
+}
+
+kvpair_t *conflate_read_begin(conflate_reader_t *reader) {
+    assert(reader->epoch == 0);
+
+    reader->epoch = reader->handle->config_epoch;
+    memory_barrier();
+    return reader->handle->current_config;
+}
+
+void conflate_read_end(conflate_reader_t *reader) {
+    memory_barrier();
+    reader->epoch = 0;
+}
@@ -28,35 +28,98 @@ conflate_config_t* dup_conf(conflate_config_t c) {
     rv->userdata = c.userdata;
     rv->log = c.log;
     rv->new_config = c.new_config;
+    rv->share_io_thread = c.share_io_thread;
+    rv->retry_initial_ms = c.retry_initial_ms;
+    rv->retry_max_ms = c.retry_max_ms;
+    rv->retry_jitter_pct = c.retry_jitter_pct;
+    rv->race_urls = c.race_urls;
+    rv->skip_unchanged_configs = c.skip_unchanged_configs;
+    rv->accept_compressed = c.accept_compressed;
+    rv->poll_interval_ms = c.poll_interval_ms;
+    rv->async_delivery = c.async_delivery;
+    rv->keep_current_config = c.keep_current_config;
+    rv->fsync_saves = c.fsync_saves;
+    rv->stream_idle_timeout_s = c.stream_idle_timeout_s;
+    rv->tcp_keepalive_idle_s = c.tcp_keepalive_idle_s;
+    rv->tcp_keepalive_interval_s = c.tcp_keepalive_interval_s;
+    rv->tcp_keepalive_count = c.tcp_keepalive_count;
+    rv->tcp_user_timeout_ms = c.tcp_user_timeout_ms;
+    rv->dns_cache_timeout_s = c.dns_cache_timeout_s;
+    rv->history_max_configs = c.history_max_configs;
+    rv->history_max_bytes = c.history_max_bytes;
+    rv->async_saves = c.async_saves;
+    if (c.resolve) {
+        rv->resolve = safe_strdup(c.resolve);
+    }
 
     rv->initialization_marker = (void*)INITIALIZATION_MAGIC;
 
     return rv;
 }
 
+static void free_conf(conflate_config_t *c) {
+    free(c->jid);
+    free(c->pass);
+    free(c->host);
+    free(c->software);
+    free(c->version);
+    free(c->save_path);
+    free(c->resolve);
+    free(c);
+}
+
 void init_conflate(conflate_config_t *conf)
 {
     assert(conf);
     memset(conf, 0x00, sizeof(conflate_config_t));
     conf->log = conflate_stderr_logger;
+    conf->retry_initial_ms = 1000;
+    conf->retry_max_ms = 30000;
+    conf->retry_jitter_pct = 20;
     conf->initialization_marker = (void*)INITIALIZATION_MAGIC;
 }
 
 bool start_conflate(conflate_config_t conf) {
+    return start_conflate_handle(conf) != NULL;
+}
+
+/* Undo a start that failed half way.  Nothing but the handle's own
+   threads knows about it yet. */
+static conflate_handle_t *abandon_handle(conflate_handle_t *handle) {
+    if (handle->saves_started) {
+        stop_save_writer(handle);
+    }
+    if (handle->delivery_started) {
+        stop_config_delivery(handle);
+    }
+    free_conf(handle->conf);
+    free(handle);
+    return NULL;
+}
+
+conflate_handle_t *start_conflate_handle(conflate_config_t conf) {
     conflate_handle_t *handle;
     void (*run_func)(void*) = NULL;
 
     /* Don't start if we don't believe initialization has occurred. */
     if (conf.initialization_marker != (void*)INITIALIZATION_MAGIC) {
         assert(conf.initialization_marker == (void*)INITIALIZATION_MAGIC);
-        return false;
+        return NULL;
     }
 
     handle = calloc(1, sizeof(conflate_handle_t));
     assert(handle);
+    cb_mutex_initialize(&handle->stats_lock);
+    init_config_delivery(handle);
+    init_config_slot(handle);
+    init_private_store(handle);
+    init_config_history(handle);
 
-    if (strncmp(HTTP_PREFIX, conf.host, strlen(HTTP_PREFIX))) {
+    if (strncmp(FILE_SOURCE_PREFIX, conf.host, strlen(FILE_SOURCE_PREFIX)) == 0) {
+        run_func = &run_file_conflate;
+    } else if (strncmp(HTTP_PREFIX, conf.host, strlen(HTTP_PREFIX))) {
         run_func = &run_rest_conflate;
+        init_rest_conflate();
     } else {
         run_func = &run_conflate;
         conflate_init_commands();
@@ -64,11 +127,34 @@ bool start_conflate(conflate_config_t conf) {
 
     handle->conf = dup_conf(conf);
 
+    if (handle->conf->async_delivery && !start_config_delivery(handle)) {
+        return abandon_handle(handle);
+    }
+
+    if (handle->conf->async_saves && !start_save_writer(handle)) {
+        return abandon_handle(handle);
+    }
+
+    if (run_func == &run_rest_conflate && handle->conf->share_io_thread) {
+        if (rest_loop_add_handle(handle)) {
+            return handle;
+        }
+        handle->conf->log(handle->conf->userdata, LOG_LVL_WARN,
+                          "Shared I/O thread unavailable, using a thread for %s",
+                          handle->conf->host);
+    }
+
     if (cb_create_thread(&handle->thread, run_func, handle, 1) == 0) {
-        return true;
-    } else {
-        perror("Failed to create thread");
+        return handle;
     }
 
-    return false;
+    perror("Failed to create thread");
+    return abandon_handle(handle);
+}
+
+void conflate_get_stats(conflate_handle_t *handle, conflate_stats_t *stats)
+{
+    cb_mutex_enter(&handle->stats_lock);
+    *stats = handle->stats;
+    cb_mutex_exit(&handle->stats_lock);
 }
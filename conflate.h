@@ -9,6 +9,7 @@ typedef BOOL bool;
 #else
 #include <stdbool.h>
 #endif
+#include <stdint.h>
 #include <sys/types.h>
 
 #ifdef __cpluscplus
@@ -102,6 +103,9 @@ typedef struct kvpair {
      * The next kv pair in this list.  NULL if this is the last.
      */
     struct kvpair* next;
+
+    /** \private */
+    int    flags;
 } kvpair_t;
 
 /**
@@ -131,6 +135,21 @@ LIBCONFLATE_PUBLIC_API
 kvpair_t* mk_kvpair(const char* k, char** v)
     __libconflate_gcc_attribute__ ((warn_unused_result, nonnull (1)));
 
+/**
+ * Create a kvpair_t that borrows its values instead of copying them.
+ *
+ * The values must stay valid for as long as the pair is in use, and
+ * ::free_kvpair will not free them.  No more values may be added to
+ * such a pair.  ::dup_kvpair makes an ordinary (owning) copy.
+ *
+ * @param k the key for this kvpair (this is copied)
+ * @param v the NULL-terminated list of values for this key
+ * @return a newly allocated kvpair_t
+ */
+LIBCONFLATE_PUBLIC_API
+kvpair_t* mk_kvpair_borrowed(const char* k, char** v)
+    __libconflate_gcc_attribute__ ((warn_unused_result, nonnull (1, 2)));
+
 /**
  * Add a value to a kvpair_t.
  *
@@ -172,7 +191,7 @@ char *get_simple_kvpair_val(kvpair_t *pair, const char *key)
 /**
  * Copy a chain of kvpairs.
  *
- * @param pair the pair to duplicate (recursively)
+ * @param pair the first pair of the chain to duplicate
  *
  * @return a complete deep copy of the kvpair structure
  */
@@ -180,6 +199,46 @@ LIBCONFLATE_PUBLIC_API
 kvpair_t *dup_kvpair(kvpair_t *pair)
     __libconflate_gcc_attribute__ ((warn_unused_result, nonnull (1)));
 
+/**
+ * Copy a chain of kvpairs into a single allocation.
+ *
+ * The copy is read-only: no values may be added to it, and only the
+ * first pair may be passed to ::free_kvpair, which releases the whole
+ * chain at once.  ::dup_kvpair of a packed chain is a single copy of
+ * the block.
+ *
+ * @param pair the chain to copy
+ * @return the first pair of the packed copy
+ */
+LIBCONFLATE_PUBLIC_API
+kvpair_t *dup_kvpair_packed(kvpair_t *pair)
+    __libconflate_gcc_attribute__ ((warn_unused_result, nonnull (1)));
+
+/**
+ * Get a reference to an immutable snapshot of a kvpair chain.
+ *
+ * Snapshots are packed chains (see ::dup_kvpair_packed) with a
+ * reference count, so any number of threads can hold on to the same
+ * config.  Retaining a snapshot only bumps its count; retaining any
+ * other chain makes a packed copy first.
+ *
+ * @param pair the first pair of the chain
+ * @return a snapshot to hand to ::kvpair_release when done with it
+ */
+LIBCONFLATE_PUBLIC_API
+kvpair_t *kvpair_retain(kvpair_t *pair)
+    __libconflate_gcc_attribute__ ((warn_unused_result, nonnull (1)));
+
+/**
+ * Drop a reference to a snapshot, freeing it with the last one.
+ *
+ * ::free_kvpair on a snapshot does the same.
+ *
+ * @param snapshot the snapshot (may be NULL)
+ */
+LIBCONFLATE_PUBLIC_API
+void kvpair_release(kvpair_t *snapshot);
+
 /**
  * Walk a kvpair.
  *
@@ -194,11 +253,117 @@ void walk_kvpair(kvpair_t *pair, void *opaque, kvpair_visitor_t visitor)
 /**
  * Free a chain of kvpairs.
  *
- * @param pair the pair to free (recursively)
+ * @param pair the first pair of the chain to free
  */
 LIBCONFLATE_PUBLIC_API
 void free_kvpair(kvpair_t* pair);
 
+/**
+ * Builds a kvpair chain in order, appending at the tail in constant
+ * time.
+ */
+typedef struct {
+    /** \private */
+    kvpair_t *head;
+    /** \private */
+    kvpair_t *tail;
+} kvpair_builder_t;
+
+/**
+ * Start an empty chain.
+ *
+ * @param builder the builder to initialize
+ */
+LIBCONFLATE_PUBLIC_API
+void init_kvpair_builder(kvpair_builder_t *builder)
+    __libconflate_gcc_attribute__ ((nonnull (1)));
+
+/**
+ * Append a new pair (see ::mk_kvpair) to the end of the chain.
+ *
+ * @param builder the builder
+ * @param k the key for the new pair
+ * @param v (optional) the list of values for the new pair
+ * @return the new pair, owned by the chain
+ */
+LIBCONFLATE_PUBLIC_API
+kvpair_t *kvpair_builder_add(kvpair_builder_t *builder,
+                             const char *k, char **v)
+    __libconflate_gcc_attribute__ ((nonnull (1, 2)));
+
+/**
+ * Take the built chain, leaving the builder empty.
+ *
+ * @param builder the builder
+ * @return the first pair of the chain (NULL if nothing was added)
+ */
+LIBCONFLATE_PUBLIC_API
+kvpair_t *kvpair_builder_finish(kvpair_builder_t *builder)
+    __libconflate_gcc_attribute__ ((warn_unused_result, nonnull (1)));
+
+/**
+ * A hash index over a kvpair chain for constant time key lookups.
+ *
+ * The index is built on the first lookup and must be invalidated
+ * whenever the chain changes.  It doesn't own the chain, and isn't
+ * safe for concurrent use without external locking.
+ */
+typedef struct kvpair_index kvpair_index_t;
+
+/**
+ * Create a lookup index over a kvpair chain.
+ *
+ * @param pair the first pair of the chain to index (may be NULL)
+ * @return a newly allocated index, see ::free_kvpair_index
+ */
+LIBCONFLATE_PUBLIC_API
+kvpair_index_t *mk_kvpair_index(kvpair_t *pair)
+    __libconflate_gcc_attribute__ ((warn_unused_result));
+
+/**
+ * Find a kvpair with the given key through an index.
+ *
+ * Like ::find_kvpair, the first pair with the key in the chain wins.
+ *
+ * @param index the index to search
+ * @param key the desired key
+ * @return the pair with the given key, or NULL if no such pair is found
+ */
+LIBCONFLATE_PUBLIC_API
+kvpair_t *find_kvpair_indexed(kvpair_index_t *index, const char *key)
+    __libconflate_gcc_attribute__ ((warn_unused_result, nonnull (1, 2)));
+
+/**
+ * Find a simple value through an index (see ::get_simple_kvpair_val).
+ *
+ * @param index the index to search
+ * @param key the key to find
+ * @return a pointer to the first value found, or NULL if none was found
+ */
+LIBCONFLATE_PUBLIC_API
+char *get_simple_kvpair_val_indexed(kvpair_index_t *index, const char *key)
+    __libconflate_gcc_attribute__ ((warn_unused_result, nonnull (1, 2)));
+
+/**
+ * Tell an index its chain changed.
+ *
+ * The index is rebuilt on the next lookup.
+ *
+ * @param index the index to invalidate
+ * @param pair the (possibly new) first pair of the chain
+ */
+LIBCONFLATE_PUBLIC_API
+void invalidate_kvpair_index(kvpair_index_t *index, kvpair_t *pair)
+    __libconflate_gcc_attribute__ ((nonnull (1)));
+
+/**
+ * Free an index.  The indexed chain is left alone.
+ *
+ * @param index the index to free (may be NULL)
+ */
+LIBCONFLATE_PUBLIC_API
+void free_kvpair_index(kvpair_index_t *index);
+
 /**
  * @}
  */
@@ -411,6 +576,14 @@ typedef struct {
      *
      * This is optional -- setting this to NULL will allow for normal
      * XMPP SRV lookups to locate the server.
+     *
+     * For REST, this is a '|' separated list of URLs.  A server
+     * listening on a Unix domain socket is reached with the socket
+     * path percent encoded in place of the host name, e.g.
+     * http+unix://%2Fvar%2Frun%2Fagent.sock/pools/default
+     *
+     * "file:/path/to/config" reads the config from a local file
+     * instead, delivering it again whenever the file is replaced.
      */
     char *host;
 
@@ -430,6 +603,10 @@ typedef struct {
 
     /**
      * Path to persist configuration for faster/more reliable restarts.
+     *
+     * Every config new_config accepts is saved here, and handed to
+     * new_config again on the next start before any server is
+     * contacted.  An empty path disables this.
      */
     char *save_path;
 
@@ -458,17 +635,218 @@ typedef struct {
      * of all of the keys and values received when things changed.
      *
      * The new config *may* be the same as the previous config.  It's
-     * up to the client to detect and decide what to do in this case.
+     * up to the client to detect and decide what to do in this case
+     * (or to set skip_unchanged_configs).
+     *
+     * The kvpair_t is read-only and only valid during the call: it
+     * may borrow its strings or be packed into one block, so don't
+     * add values to it or free any part of it.  To keep or modify it,
+     * copy it with ::dup_kvpair (or, to keep it unchanged, take a
+     * cheaper snapshot with ::kvpair_retain).
      *
      * The callback should return CONFLATE_SUCCESS on success.
      */
     conflate_result (*new_config)(void*, kvpair_t*);
 
+    /**
+     * Drive this handle's REST config stream from a single I/O thread
+     * shared by every handle started with this flag set, rather than
+     * from a thread of its own.
+     *
+     * Callbacks for all such handles then run on that one thread, so
+     * a slow new_config delays the others.  Falls back to a thread
+     * per handle where the shared loop isn't supported.
+     */
+    bool share_io_thread;
+
+    /**
+     * Delay (in milliseconds) before walking the REST URL list again.
+     *
+     * The delay doubles after every pass that fails to produce a
+     * config, up to retry_max_ms.  A URL that fails is also skipped
+     * on later passes until its own backoff expires.  Retries are
+     * never less than a millisecond apart.
+     */
+    unsigned int retry_initial_ms;
+
+    /**
+     * Upper bound (in milliseconds) for the REST retry delay.
+     */
+    unsigned int retry_max_ms;
+
+    /**
+     * Percentage (0-100) of each retry delay that is randomized so
+     * many clients don't reconnect in lockstep.
+     */
+    unsigned int retry_jitter_pct;
+
+    /**
+     * Number of URLs from the REST host list to connect to at once.
+     *
+     * When greater than one, the first that many usable URLs are
+     * raced: the first connection to deliver a config the new_config
+     * callback accepts is kept and the others are cancelled, so a
+     * black-holed node doesn't cost a full connect timeout.  Zero or
+     * one tries the URLs strictly in order.
+     */
+    unsigned int race_urls;
+
+    /**
+     * Don't call new_config for a REST config whose contents are
+     * identical to the last one new_config accepted.
+     *
+     * Streams resend the full config on every reconnect; with this
+     * set only actual changes reach the callback.  Skipped configs
+     * are counted in ::conflate_stats_t.
+     */
+    bool skip_unchanged_configs;
+
+    /**
+     * Ask REST servers for gzip or deflate compressed responses.
+     *
+     * Compressed streams are inflated incrementally, so configs are
+     * still delivered as soon as their last byte arrives.
+     */
+    bool accept_compressed;
+
+    /**
+     * Poll non-streaming REST endpoints every poll_interval_ms
+     * milliseconds using conditional requests.
+     *
+     * The ETag and Last-Modified of each URL's last config are sent
+     * back as If-None-Match and If-Modified-Since; a 304 answer keeps
+     * the current config without downloading it again or calling
+     * new_config.  Zero disables polling mode.
+     */
+    unsigned int poll_interval_ms;
+
+    /**
+     * Call new_config from a dedicated thread instead of the thread
+     * reading the config source.
+     *
+     * A slow callback then doesn't hold up reading from the network.
+     * Only the newest pending config is delivered; configs replaced
+     * before the callback got to them are dropped and counted in
+     * conflate_stats_t.configs_coalesced.  A config the callback
+     * rejects isn't kept, saved or added to the history, but the
+     * source can't move on to the next REST URL because of it.  The
+     * config handed to new_config is already a snapshot in this mode,
+     * so ::kvpair_retain on it doesn't copy.
+     */
+    bool async_delivery;
+
+    /**
+     * Keep the last config new_config accepted as the handle's
+     * current config, for other threads to read without locking (see
+     * ::conflate_read_begin).
+     */
+    bool keep_current_config;
+
+    /**
+     * fsync() saved configs (and the rename replacing the old one)
+     * before carrying on, so an accepted config survives a power
+     * failure and not just a crash.
+     */
+    bool fsync_saves;
+
+    /**
+     * Drop a REST stream after this many seconds without receiving a
+     * byte and move on to the next URL.
+     *
+     * Only useful against servers sending heartbeats on idle streams,
+     * otherwise a quiet but healthy stream gets cut too.  Zero waits
+     * for TCP to notice the connection is gone.
+     */
+    unsigned int stream_idle_timeout_s;
+
+    /**
+     * TCP keepalive tuning for REST connections (TCP_KEEPIDLE,
+     * TCP_KEEPINTVL and TCP_KEEPCNT).  Zero keeps the system default.
+     */
+    unsigned int tcp_keepalive_idle_s;
+    unsigned int tcp_keepalive_interval_s;
+    unsigned int tcp_keepalive_count;
+
+    /**
+     * Fail a REST connection when sent data stays unacknowledged for
+     * this long (TCP_USER_TIMEOUT, where supported).  Zero keeps the
+     * system default.
+     */
+    unsigned int tcp_user_timeout_ms;
+
+    /**
+     * Seconds REST host names stay in the DNS cache shared by all
+     * handles.  Zero keeps curl's default of 60 seconds.
+     */
+    unsigned int dns_cache_timeout_s;
+
+    /**
+     * Comma separated "host:port:address" entries pinning REST host
+     * names to addresses, bypassing DNS (see CURLOPT_RESOLVE).
+     */
+    char *resolve;
+
+    /**
+     * Keep this many of the last accepted configs next to save_path,
+     * for rolling back to with ::conflate_redeliver_config.  Zero keeps
+     * no history.
+     */
+    unsigned int history_max_configs;
+
+    /**
+     * Drop the oldest kept configs once they take more than this many
+     * bytes on disk (compressed).  The newest config is always kept.
+     * Zero means no limit beyond history_max_configs.
+     */
+    uint64_t history_max_bytes;
+
+    /**
+     * Write saved configs, private data and history from a background
+     * thread, so a slow disk (fsync_saves on a busy volume) doesn't
+     * hold up config delivery.  Saves of a file made while an earlier
+     * one is still queued are merged into one write and counted in
+     * conflate_stats_t.saves_coalesced.  ::save_kvpairs and
+     * ::conflate_save_private then return once the write is queued;
+     * failures are only logged, though private data is rewritten in
+     * full after a failed write.  See ::conflate_flush_saves.
+     */
+    bool async_saves;
+
     /** \private */
     void *initialization_marker;
 
 } conflate_config_t;
 
+/**
+ * Counters describing what a conflate handle has been doing.
+ */
+typedef struct {
+    /** Configs handed to new_config. */
+    uint64_t configs_delivered;
+    /** Configs not handed to new_config because they were unchanged. */
+    uint64_t configs_unchanged;
+    /** REST response body bytes received (compressed if compression is used). */
+    uint64_t bytes_received;
+    /** REST response body bytes after decompression. */
+    uint64_t bytes_decoded;
+    /** Conditional polls answered with 304 Not Modified. */
+    uint64_t configs_not_modified;
+    /** Configs dropped by async_delivery because a newer one arrived. */
+    uint64_t configs_coalesced;
+    /** Files written (or appended to) by saves. */
+    uint64_t saves_written;
+    /** Saves that failed. */
+    uint64_t saves_failed;
+    /** Saves merged into a pending write of the same file (async_saves). */
+    uint64_t saves_coalesced;
+    /** Nanoseconds spent writing saves, fsync excluded: total and worst. */
+    uint64_t save_write_ns;
+    uint64_t save_write_max_ns;
+    /** Nanoseconds spent in fsync for saves (fsync_saves): total and worst. */
+    uint64_t save_fsync_ns;
+    uint64_t save_fsync_max_ns;
+} conflate_stats_t;
+
 /**
  * @}
  */
@@ -498,6 +876,147 @@ void init_conflate(conflate_config_t *conf) __libconflate_gcc_attribute__ ((nonn
 LIBCONFLATE_PUBLIC_API
 bool start_conflate(conflate_config_t conf) __libconflate_gcc_attribute__ ((warn_unused_result));
 
+/**
+ * Start a conflate agent and return its handle.
+ *
+ * This is ::start_conflate for callers that want to inspect the agent
+ * afterwards (for example with ::conflate_get_stats).
+ *
+ * @param conf configuration for libconflate
+ *
+ * @return the new handle, or NULL if libconflate could not initialize
+ */
+LIBCONFLATE_PUBLIC_API
+conflate_handle_t *start_conflate_handle(conflate_config_t conf)
+    __libconflate_gcc_attribute__ ((warn_unused_result));
+
+/**
+ * Get a consistent copy of a handle's counters.
+ *
+ * This may be called from any thread.
+ *
+ * @param handle the conflate handle
+ * @param stats where to store the counters
+ */
+LIBCONFLATE_PUBLIC_API
+void conflate_get_stats(conflate_handle_t *handle, conflate_stats_t *stats)
+    __libconflate_gcc_attribute__ ((nonnull (1, 2)));
+
+/**
+ * Wait until everything the handle was asked to save so far is written
+ * (see conflate_config_t.async_saves).  Returns at once without
+ * async_saves.
+ *
+ * This may be called from any thread.
+ *
+ * @param handle the conflate handle
+ */
+LIBCONFLATE_PUBLIC_API
+void conflate_flush_saves(conflate_handle_t *handle)
+    __libconflate_gcc_attribute__ ((nonnull (1)));
+
+/**
+ * A config in a handle's history (see conflate_config_t.history_max_configs).
+ */
+typedef struct {
+    /** Identifies the config, see ::conflate_redeliver_config. */
+    uint64_t hash;
+    /** When it was last accepted, in seconds since the epoch. */
+    uint64_t saved_at;
+    /** Its size in the saved config format. */
+    uint64_t size;
+    /** What it takes on disk. */
+    uint64_t stored_size;
+} conflate_history_entry_t;
+
+/**
+ * List the configs in a handle's history, newest (the current one)
+ * first.
+ *
+ * This may be called from any thread.
+ *
+ * @param handle the conflate handle
+ * @param entries where to store the entries
+ * @param max how many entries there's room for
+ *
+ * @return how many entries were stored
+ */
+LIBCONFLATE_PUBLIC_API
+size_t conflate_get_history(conflate_handle_t *handle,
+                            conflate_history_entry_t *entries, size_t max)
+    __libconflate_gcc_attribute__ ((nonnull (1)));
+
+/**
+ * Hand a config from a handle's history to new_config again, as if the
+ * config source had sent it.  If new_config accepts it, it becomes the
+ * current and saved config until the source sends a different one.
+ *
+ * new_config is called on the calling thread, or on the delivery
+ * thread with async_delivery set (the result is then CONFLATE_SUCCESS
+ * once the config is queued).
+ *
+ * @param handle the conflate handle
+ * @param hash the config's conflate_history_entry_t.hash
+ *
+ * @return new_config's result, or CONFLATE_ERROR if the config isn't
+ *         in the history or can't be read back
+ */
+LIBCONFLATE_PUBLIC_API
+conflate_result conflate_redeliver_config(conflate_handle_t *handle, uint64_t hash)
+    __libconflate_gcc_attribute__ ((nonnull (1)));
+
+/**
+ * A thread's registration for reading a handle's current config.
+ */
+typedef struct conflate_reader conflate_reader_t;
+
+/**
+ * Register the calling thread as a reader of a handle's current
+ * config.  The handle must have been started with
+ * keep_current_config set.
+ *
+ * Each thread reading the config needs its own registration.
+ *
+ * @param handle the conflate handle
+ * @return the reader, see ::conflate_unregister_reader
+ */
+LIBCONFLATE_PUBLIC_API
+conflate_reader_t *conflate_register_reader(conflate_handle_t *handle)
+    __libconflate_gcc_attribute__ ((warn_unused_result, nonnull (1)));
+
+/**
+ * Give up a reader registration.
+ *
+ * @param reader the reader (may be NULL)
+ */
+LIBCONFLATE_PUBLIC_API
+void conflate_unregister_reader(conflate_reader_t *reader);
+
+/**
+ * Start reading the current config.
+ *
+ * This takes no lock and copies nothing.  The returned config stays
+ * valid until ::conflate_read_end, even if a newer one is published
+ * meanwhile; ::kvpair_retain it to keep it longer.  Read sections
+ * don't nest, and while one is open, configs replaced since it began
+ * can't be freed, so keep them short.
+ *
+ * @param reader the calling thread's reader
+ * @return the current config, or NULL if there is none yet
+ */
+LIBCONFLATE_PUBLIC_API
+kvpair_t *conflate_read_begin(conflate_reader_t *reader)
+    __libconflate_gcc_attribute__ ((warn_unused_result, nonnull (1)));
+
+/**
+ * Finish reading the config returned by ::conflate_read_begin.
+ *
+ * @param reader the calling thread's reader
+ */
+LIBCONFLATE_PUBLIC_API
+void conflate_read_end(conflate_reader_t *reader)
+    __libconflate_gcc_attribute__ ((nonnull (1)));
+
 /**
  * @}
  */
@@ -535,6 +1054,27 @@ LIBCONFLATE_PUBLIC_API
 kvpair_t* load_kvpairs(conflate_handle_t *handle, const char *filename)
     __libconflate_gcc_attribute__ ((warn_unused_result, nonnull(1, 2)));
 
+/**
+ * Load the key/value pairs from the file at the given path without
+ * reading it.
+ *
+ * The file is mapped copy-on-write and the pairs point into the
+ * mapping, so processes loading the same saved config share the pages
+ * none of them modify, and
+ * loading costs the same however large the values are.  Unlike
+ * load_kvpairs() the file's checksum isn't verified, only its
+ * structure.  The result is a snapshot (see ::kvpair_retain); the
+ * mapping goes away when it's freed.
+ *
+ * @param handle the conflate handle (for logging contexts and stuff)
+ * @param filename the path from which the config should be read
+ *
+ * @return the config, or NULL if the config could not be read for any reason
+ */
+LIBCONFLATE_PUBLIC_API
+kvpair_t* load_kvpairs_mapped(conflate_handle_t *handle, const char *filename)
+    __libconflate_gcc_attribute__ ((warn_unused_result, nonnull(1, 2)));
+
 /**
  * Save a config at the given path.
  *
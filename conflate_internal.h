@@ -4,6 +4,8 @@
 
 #include <platform/platform.h>
 
+#include "rest.h"
+
 #ifdef CONFLATE_USE_XMPP
 #include <strophe.h>
 #else
@@ -21,8 +23,173 @@ struct _conflate_handle {
     cb_thread_t thread;
 
     char *url; /* Current URL for debuggability. */
+
+    struct rest_stream stream; /* REST config assembly state. */
+    int tot_process_new_configs;
+
+    char *hosts;           /* Private copy of conf->host, split in place. */
+    struct rest_url *urls;
+    int nurls;
+    char *userpass;
+    struct curl_slist *resolve; /* Parsed conf->resolve. */
+    int failed_rounds;     /* Consecutive passes over urls without a config. */
+    unsigned int retry_seed;
+
+    cb_mutex_t callback_lock;  /* Held around every new_config call. */
+    uint64_t last_config_hash; /* Hash and length of the last */
+    size_t last_config_len;    /* accepted config, under callback_lock */
+    bool have_last_config_hash; /* (delivery_lock with async_delivery). */
+
+    cb_mutex_t stats_lock;
+    conflate_stats_t stats;
+
+    /* Async delivery (conf->async_delivery) state. */
+    bool delivery_started;
+    cb_thread_t delivery_thread;
+    cb_mutex_t delivery_lock;
+    cb_cond_t delivery_cond;
+    kvpair_t *pending_config; /* Newest config not yet delivered, */
+    uint64_t pending_hash;    /* and its hash and length. */
+    size_t pending_len;
+    bool delivering;          /* A config is in new_config. */
+    bool delivery_stopping;   /* Cleared by the thread as it exits. */
+
+    /* Current config slot (conf->keep_current_config), see config_slot.c. */
+    cb_mutex_t slot_lock;
+    kvpair_t *volatile current_config;
+    volatile unsigned long config_epoch;
+    struct conflate_reader *readers;
+    struct retired_config *retired;
+
+    /* conflate_save_private() data, see persist.c. */
+    cb_mutex_t private_lock;
+    struct private_store *private_store;
+
+    /* conf->history_max_configs state, see history.c. */
+    cb_mutex_t history_lock;
+    struct config_history *history;
+
+    /* Background saves (conf->async_saves), see persist_writer.c. */
+    bool saves_started;
+    cb_thread_t save_thread;
+    cb_mutex_t save_lock;
+    cb_cond_t save_cond;     /* Something was queued. */
+    cb_cond_t saved_cond;    /* Something was written. */
+    struct save_job *save_queue;
+    struct save_failure *save_failures; /* Files a write failed to. */
+    uint64_t save_seq;       /* Requests so far. */
+    uint64_t save_busy_seq;  /* The oldest request being written, or 0. */
+    bool save_stopping;      /* Cleared by the thread as it exits. */
 };
 
 void conflate_init_commands(void);
 
+/* Hand a '\0' terminated config of len bytes to new_config (or the
+   delivery thread), as the CONFIG_KEY pair along with a "url" pair
+   naming its source.  Returns the callback's verdict. */
+conflate_result deliver_config(conflate_handle_t *handle, char *config,
+                               size_t len, char *source);
+
+/* Set up the handle's delivery to new_config. */
+void init_config_delivery(conflate_handle_t *handle);
+
+/* Make a config new_config took current, and keep it for the next
+   start and for rolling back to.  The caller holds callback_lock. */
+void accept_config(conflate_handle_t *handle, kvpair_t *kv);
+
+/* Start the delivery thread of a handle using async_delivery. */
+bool start_config_delivery(conflate_handle_t *handle);
+
+/* Make the delivery thread exit, dropping any config still queued. */
+void stop_config_delivery(conflate_handle_t *handle);
+
+/* Queue kv (taking ownership) for the delivery thread, replacing any
+   config still waiting to be delivered.  hash and len identify its
+   config for skip_unchanged_configs once it's accepted. */
+void queue_config(conflate_handle_t *handle, kvpair_t *kv,
+                  uint64_t hash, size_t len);
+
+/* Set up the handle's current config slot. */
+void init_config_slot(conflate_handle_t *handle);
+
+/* Make (a snapshot of) kv the handle's current config. */
+void publish_config(conflate_handle_t *handle, kvpair_t *kv);
+
+/* Make an immutable chain of npairs pairs whose strings live in a
+   backing buffer, handed to release (if not NULL) when the chain is
+   freed.  The caller sets each pair's key and values; *values points
+   to room for nvalues + npairs value pointers (values lists are NULL
+   terminated) and used_values/allocated_values must match.  The result
+   is a snapshot, see kvpair_retain(). */
+kvpair_t *mk_kvpair_view(size_t npairs, size_t nvalues, char ***values,
+                         void *backing, size_t backing_size,
+                         void (*release)(void *backing, size_t size));
+
+void init_private_store(conflate_handle_t *handle);
+
+void init_config_history(conflate_handle_t *handle);
+
+/* Add a config new_config accepted to the handle's history, if it
+   keeps one. */
+void record_config_history(conflate_handle_t *handle, kvpair_t *kv);
+
+/* Deliver a config from the history like one from the source, taking
+   ownership of kv. */
+conflate_result redeliver_config(conflate_handle_t *handle, kvpair_t *kv);
+
+/* Serialize a chain in the saved config format (see persist.c). */
+unsigned char *encode_kvpairs(kvpair_t *pairs, size_t *size);
+
+/* Parse a saved config, NULL if it's corrupt. */
+kvpair_t *decode_kvpairs(const unsigned char *buf, size_t size);
+
+/* Replace filename with data through a temporary file and a rename,
+   syncing it to disk first if conf->fsync_saves is set. */
+bool write_file_atomically(conflate_handle_t *handle, const char *filename,
+                           const void *data, size_t size);
+
+/* Append data to filename, syncing it like write_file_atomically. */
+bool append_file(conflate_handle_t *handle, const char *filename,
+                 const void *data, size_t size);
+
+enum save_op {
+    SAVE_REPLACE,
+    SAVE_APPEND,
+    SAVE_REMOVE
+};
+
+/* Replace, append to or remove a file, taking ownership of data (NULL
+   for SAVE_REMOVE).  Once start_save_writer() has run this only queues
+   the write, merged with any still pending for the same file, and
+   reports success; see persist_writer.c. */
+bool persist_file(conflate_handle_t *handle, const char *filename,
+                  void *data, size_t size, enum save_op op);
+
+bool start_save_writer(conflate_handle_t *handle);
+
+/* Whether a queued write to filename failed since this was last
+   asked.  Appends to such a file are dropped until it's replaced. */
+bool save_failed(conflate_handle_t *handle, const char *filename);
+
+/* Write out everything queued, then make the save writer exit. */
+void stop_save_writer(conflate_handle_t *handle);
+
+/* Hosts starting with this name a local file to read configs from. */
+#define FILE_SOURCE_PREFIX "file:"
+
+/* Thread body delivering configs from a "file:" host. */
+void run_file_conflate(void *arg);
+
+#define CONFLATE_ONCE_INIT 0
+#define CONFLATE_ONCE_RUNNING 1
+#define CONFLATE_ONCE_DONE 2
+
+/* Run init exactly once for a once flag starting as CONFLATE_ONCE_INIT,
+   however many threads get here at the same time.  None of them
+   returns before init has. */
+void conflate_once(volatile long *once, void (*init)(void));
+
+/* 64-bit FNV-1a hash of a buffer. */
+uint64_t conflate_hash(const void *data, size_t len);
+
 #endif /* CONFLATE_INTERNAL_H */
@@ -0,0 +1,271 @@
+/*
+ * Delivery of configs to the application's new_config callback, the
+ * same whichever source (REST, a local file) they came from.
+ *
+ * With conflate_config_t.async_delivery set, the thread receiving
+ * configs only queues them; a delivery thread per handle calls
+ * new_config.  Just one config is ever pending: a config that arrives
+ * while another is still waiting replaces it, since only the newest
+ * one matters to the application.
+ *
+ * Either way new_config is only ever called once at a time per handle,
+ * under callback_lock, so a rollback from the application's thread
+ * can't interleave with a config from the source.
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "conflate.h"
+#include "conflate_internal.h"
+
+void accept_config(conflate_handle_t *handle, kvpair_t *kv) {
+    const char *path = handle->conf->save_path;
+
+    if (handle->conf->keep_current_config) {
+        publish_config(handle, kv);
+    }
+    if (path != NULL && *path != '\0' && !save_kvpairs(handle, kv, path)) {
+        handle->conf->log(handle->conf->userdata, LOG_LVL_ERROR,
+                          "Can not save config to %s", path);
+    }
+    record_config_history(handle, kv);
+}
+
+/* Remember the config the application took, for skip_unchanged_configs. */
+static void remember_config(conflate_handle_t *handle, uint64_t hash,
+                            size_t len) {
+    handle->last_config_hash = hash;
+    handle->last_config_len = len;
+    handle->have_last_config_hash = true;
+}
+
+/* The hash and length deliver_config() gives a config, for one that
+   didn't come from a source. */
+static void hash_config(kvpair_t *kv, uint64_t *hash, size_t *len) {
+    const char *config = get_simple_kvpair_val(kv, CONFIG_KEY);
+
+    *len = config ? strlen(config) : 0;
+    *hash = conflate_hash(config ? config : "", *len);
+}
+
+void init_config_delivery(conflate_handle_t *handle) {
+    cb_mutex_initialize(&handle->callback_lock);
+}
+
+/* Hand kv to new_config, with callback_lock held, making it the
+   current config if it's accepted. */
+static conflate_result call_new_config(conflate_handle_t *handle,
+                                       kvpair_t *kv) {
+    conflate_result r = handle->conf->new_config(handle->conf->userdata, kv);
+
+    cb_mutex_enter(&handle->stats_lock);
+    handle->stats.configs_delivered++;
+    cb_mutex_exit(&handle->stats_lock);
+
+    if (r == CONFLATE_SUCCESS) {
+        accept_config(handle, kv);
+    }
+    return r;
+}
+
+static void run_delivery(void *arg) {
+    conflate_handle_t *handle = (conflate_handle_t *) arg;
+    kvpair_t *kv;
+    uint64_t hash;
+    size_t len;
+    conflate_result r;
+
+    cb_mutex_enter(&handle->delivery_lock);
+    for (;;) {
+        while (handle->pending_config == NULL && !handle->delivery_stopping) {
+            cb_cond_wait(&handle->delivery_cond, &handle->delivery_lock);
+        }
+        if (handle->delivery_stopping) {
+            break;
+        }
+        kv = handle->pending_config;
+        hash = handle->pending_hash;
+        len = handle->pending_len;
+        handle->pending_config = NULL;
+        handle->delivering = true;
+        cb_mutex_exit(&handle->delivery_lock);
+
+        /* Nobody is left to try another source, but a rejected config
+           still mustn't become the current one. */
+        cb_mutex_enter(&handle->callback_lock);
+        r = call_new_config(handle, kv);
+        cb_mutex_exit(&handle->callback_lock);
+
+        free_kvpair(kv);
+
+        cb_mutex_enter(&handle->delivery_lock);
+        if (r == CONFLATE_SUCCESS) {
+            remember_config(handle, hash, len);
+        }
+        handle->delivering = false;
+    }
+
+    handle->delivery_stopping = false;
+    cb_cond_broadcast(&handle->delivery_cond);
+    cb_mutex_exit(&handle->delivery_lock);
+}
+
+bool start_config_delivery(conflate_handle_t *handle) {
+    cb_mutex_initialize(&handle->delivery_lock);
+    cb_cond_initialize(&handle->delivery_cond);
+    handle->pending_config = NULL;
+    handle->delivering = false;
+    handle->delivery_stopping = false;
+
+    if (cb_create_thread(&handle->delivery_thread, run_delivery,
+                         handle, 1) != 0) {
+        perror("Failed to create delivery thread");
+        return false;
+    }
+    handle->delivery_started = true;
+    return true;
+}
+
+void stop_config_delivery(conflate_handle_t *handle) {
+    cb_mutex_enter(&handle->delivery_lock);
+    handle->delivery_stopping = true;
+    cb_cond_broadcast(&handle->delivery_cond);
+    while (handle->delivery_stopping) {
+        cb_cond_wait(&handle->delivery_cond, &handle->delivery_lock);
+    }
+    handle->delivery_started = false;
+    cb_mutex_exit(&handle->delivery_lock);
+
+    free_kvpair(handle->pending_config);
+    handle->pending_config = NULL;
+}
+
+void queue_config(conflate_handle_t *handle, kvpair_t *kv,
+                  uint64_t hash, size_t len) {
+    kvpair_t *superseded;
+
+    cb_mutex_enter(&handle->delivery_lock);
+    superseded = handle->pending_config;
+    handle->pending_config = kv;
+    handle->pending_hash = hash;
+    handle->pending_len = len;
+    cb_cond_signal(&handle->delivery_cond);
+    cb_mutex_exit(&handle->delivery_lock);
+
+    if (superseded != NULL) {
+        cb_mutex_enter(&handle->stats_lock);
+        handle->stats.configs_coalesced++;
+        cb_mutex_exit(&handle->stats_lock);
+
+        free_kvpair(superseded);
+    }
+}
+
+/* Whether the config is the one the application already has.  With
+   async_delivery a config on its way to new_config may replace it, so
+   only while the delivery thread is idle.  Otherwise the caller holds
+   callback_lock. */
+static bool config_unchanged(conflate_handle_t *handle, uint64_t hash,
+                             size_t len) {
+    bool unchanged;
+
+    if (!handle->conf->async_delivery) {
+        return handle->have_last_config_hash &&
+            handle->last_config_hash == hash &&
+            handle->last_config_len == len;
+    }
+
+    cb_mutex_enter(&handle->delivery_lock);
+    unchanged = handle->pending_config == NULL && !handle->delivering &&
+        handle->have_last_config_hash &&
+        handle->last_config_hash == hash &&
+        handle->last_config_len == len;
+    cb_mutex_exit(&handle->delivery_lock);
+    return unchanged;
+}
+
+conflate_result deliver_config(conflate_handle_t *handle, char *config,
+                               size_t len, char *source) {
+    char *values[2];
+    kvpair_t *kv;
+    conflate_result r;
+    uint64_t hash;
+    bool async = handle->conf->async_delivery;
+
+    values[0] = config;
+    values[1] = NULL;
+
+    /* Sources resend the same config on every reconnect, so let the
+       application skip rebuilding its state when nothing changed. */
+    hash = conflate_hash(config, len);
+    if (!async) {
+        cb_mutex_enter(&handle->callback_lock);
+    }
+    if (handle->conf->skip_unchanged_configs &&
+        config_unchanged(handle, hash, len)) {
+        if (!async) {
+            cb_mutex_exit(&handle->callback_lock);
+        }
+        cb_mutex_enter(&handle->stats_lock);
+        handle->stats.configs_unchanged++;
+        cb_mutex_exit(&handle->stats_lock);
+        return CONFLATE_SUCCESS;
+    }
+
+    /* Borrow the caller's buffer rather than copy it. */
+    kv = mk_kvpair_borrowed(CONFIG_KEY, values);
+
+    if (source != NULL) {
+        char *url[2];
+        url[0] = source;
+        url[1] = NULL;
+        kv->next = mk_kvpair_borrowed("url", url);
+    }
+
+    if (async) {
+        /* The caller reuses its buffer while the config waits in the
+           queue, so the delivery thread needs its own copy.  It's
+           remembered as the current config once new_config took it. */
+        queue_config(handle, dup_kvpair_packed(kv), hash, len);
+        r = CONFLATE_SUCCESS;
+    } else {
+        /* Only a config the application took counts as the
+           current one. */
+        r = call_new_config(handle, kv);
+        if (r == CONFLATE_SUCCESS) {
+            remember_config(handle, hash, len);
+        }
+        cb_mutex_exit(&handle->callback_lock);
+    }
+
+    /* clean up */
+    free_kvpair(kv);
+
+    return r;
+}
+
+conflate_result redeliver_config(conflate_handle_t *handle, kvpair_t *kv) {
+    conflate_result r;
+    uint64_t hash;
+    size_t len;
+
+    /* The rolled back config is the current one once it's accepted,
+       so the source resending what it had isn't skipped. */
+    hash_config(kv, &hash, &len);
+    if (handle->conf->async_delivery) {
+        queue_config(handle, kv, hash, len);
+        return CONFLATE_SUCCESS;
+    }
+
+    cb_mutex_enter(&handle->callback_lock);
+    r = call_new_config(handle, kv);
+    if (r == CONFLATE_SUCCESS) {
+        remember_config(handle, hash, len);
+    }
+    cb_mutex_exit(&handle->callback_lock);
+    free_kvpair(kv);
+
+    return r;
+}
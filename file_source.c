@@ -0,0 +1,226 @@
+/*
+ * Configs read from a local file, for hosts whose orchestration drops
+ * config files in place rather than serving them over REST.
+ *
+ * conf->host is "file:" followed by the path.  The file is delivered
+ * when the handle starts and again each time it's replaced (renamed
+ * over, the atomic way to publish it) or rewritten in place.  On Linux
+ * the directory is watched with inotify, and watched again if it's
+ * removed and replaced; elsewhere, or when the watch can't be set up,
+ * the file is checked every poll_interval_ms (or every second).
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <time.h>
+#endif
+
+#ifdef __linux__
+#include <errno.h>
+#include <limits.h>
+#include <sys/inotify.h>
+#endif
+
+#include "conflate.h"
+#include "conflate_internal.h"
+
+#define FILE_POLL_MS 1000
+
+static const char *file_source_path(const char *host) {
+    if (strncmp(host, FILE_SOURCE_PREFIX "//", strlen(FILE_SOURCE_PREFIX "//")) == 0) {
+        return host + strlen(FILE_SOURCE_PREFIX "//");
+    }
+    return host + strlen(FILE_SOURCE_PREFIX);
+}
+
+/* Read the whole file and deliver it, returning the application's
+   verdict, or CONFLATE_ERROR_BAD_SOURCE if the file couldn't be read. */
+static conflate_result deliver_file(conflate_handle_t *handle,
+                                    const char *path) {
+    FILE *fp = fopen(path, "rb");
+    char *data;
+    size_t size = 4096;
+    size_t used = 0;
+    size_t n;
+    conflate_result r;
+
+    if (fp == NULL) {
+        return CONFLATE_ERROR_BAD_SOURCE;
+    }
+
+    data = malloc(size);
+    assert(data);
+    while ((n = fread(data + used, 1, size - used - 1, fp)) > 0) {
+        used += n;
+        if (size - used - 1 == 0) {
+            size <<= 1;
+            data = realloc(data, size);
+            assert(data);
+        }
+    }
+    fclose(fp);
+    data[used] = '\0';
+
+    handle->tot_process_new_configs++;
+    r = deliver_config(handle, data, used, handle->conf->host);
+    free(data);
+
+    if (r != CONFLATE_SUCCESS) {
+        handle->conf->log(handle->conf->userdata, LOG_LVL_WARN,
+                          "Config from %s was rejected (%d)", path, r);
+    }
+    return r;
+}
+
+static void sleep_ms(unsigned int ms) {
+#ifdef WIN32
+    Sleep(ms);
+#else
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (long) (ms % 1000) * 1000000;
+    nanosleep(&ts, NULL);
+#endif
+}
+
+/* Deliver the file whenever its size or modification time changes,
+   or as soon as it's there unless what's there was delivered. */
+static void poll_file(conflate_handle_t *handle, const char *path,
+                      bool delivered) {
+    unsigned int interval = handle->conf->poll_interval_ms ?
+        handle->conf->poll_interval_ms : FILE_POLL_MS;
+    struct stat last, st;
+    bool have_last = delivered && stat(path, &last) == 0;
+
+    for (;;) {
+        sleep_ms(interval);
+
+        if (stat(path, &st) != 0) {
+            have_last = false;
+            continue;
+        }
+        if (have_last && st.st_mtime == last.st_mtime &&
+            st.st_size == last.st_size && st.st_ino == last.st_ino) {
+            continue;
+        }
+        /* Only a file that had nothing usable in it is tried again
+           before it changes. */
+        if (deliver_file(handle, path) != CONFLATE_ERROR_BAD_SOURCE) {
+            last = st;
+            have_last = true;
+        }
+    }
+}
+
+#ifdef __linux__
+/* Watch the file's directory, returning -1 if that can't be done. */
+static int watch_dir(conflate_handle_t *handle, const char *path) {
+    char *dir = safe_strdup(path);
+    char *slash = strrchr(dir, '/');
+    int fd;
+
+    if (slash == NULL) {
+        strcpy(dir, ".");
+    } else if (slash == dir) {
+        dir[1] = '\0';
+    } else {
+        *slash = '\0';
+    }
+
+    /* Renaming over the file or rewriting it in place, and the
+       directory itself going away. */
+    fd = inotify_init();
+    if (fd >= 0 && inotify_add_watch(fd, dir, IN_MOVED_TO | IN_CLOSE_WRITE |
+                                     IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd < 0) {
+        handle->conf->log(handle->conf->userdata, LOG_LVL_WARN,
+                          "Can't watch %s (%s), polling it instead",
+                          dir, strerror(errno));
+    }
+
+    free(dir);
+    return fd;
+}
+
+/* Returns true when the directory was removed or moved away, so a
+   directory replacing it can be watched, and false if the watch
+   broke. */
+static bool follow_watch(conflate_handle_t *handle, int fd, const char *path) {
+    const char *slash = strrchr(path, '/');
+    const char *name = slash ? slash + 1 : path;
+    char events[sizeof(struct inotify_event) + NAME_MAX + 1]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    for (;;) {
+        ssize_t len = read(fd, events, sizeof(events));
+        ssize_t off = 0;
+        bool changed = false;
+        bool gone = false;
+
+        if (len <= 0) {
+            if (len < 0 && errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            return false;
+        }
+
+        while (off < len) {
+            struct inotify_event *ev = (struct inotify_event *) (events + off);
+            if (ev->len > 0 && strcmp(ev->name, name) == 0) {
+                changed = true;
+            }
+            if (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+                gone = true;
+            }
+            off += sizeof(struct inotify_event) + ev->len;
+        }
+
+        if (changed) {
+            deliver_file(handle, path);
+        }
+        if (gone) {
+            close(fd);
+            return true;
+        }
+    }
+}
+#endif
+
+void run_file_conflate(void *arg) {
+    conflate_handle_t *handle = (conflate_handle_t *) arg;
+    const char *path = file_source_path(handle->conf->host);
+#ifdef __linux__
+    /* Watch before the first read so no update slips in between. */
+    int fd = watch_dir(handle, path);
+#endif
+
+    if (deliver_file(handle, path) == CONFLATE_ERROR_BAD_SOURCE) {
+        /* Nothing usable published yet, start from the last known
+           config. */
+        process_saved_config(handle);
+    }
+
+#ifdef __linux__
+    while (fd >= 0 && follow_watch(handle, fd, path)) {
+        /* Whatever replaced the directory may hold a new file. */
+        fd = watch_dir(handle, path);
+        if (fd < 0) {
+            poll_file(handle, path, false);
+        }
+        deliver_file(handle, path);
+    }
+#endif
+    poll_file(handle, path, true);
+}
@@ -0,0 +1,388 @@
+/*
+ * The last few accepted configs (conflate_config_t.history_max_configs),
+ * so a bad push can be rolled back without the config server.
+ *
+ * Each config is kept in the saved config format (see persist.c),
+ * deflated, at <save_path>.history.<hash>, with hash the
+ * conflate_hash of that encoding.  A config accepted again is the
+ * same file, so it only moves to the front.  <save_path>.history is
+ * the index, a line per config, oldest first:
+ *
+ *   hash size stored-size saved-at z|r
+ *
+ * (hex, then decimal; 'r' when stored without compression).  Both are
+ * replaced atomically (see persist_file), the index is written after
+ * the config it names and trimmed configs are removed after the index
+ * that drops them, so a crash at worst leaves a stray file.
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "conflate.h"
+#include "conflate_internal.h"
+
+#define HISTORY_SUFFIX ".history"
+#define HISTORY_LINE_MAX 128
+
+struct history_entry {
+    uint64_t hash;
+    uint64_t size;
+    uint64_t stored_size;
+    uint64_t saved_at;
+    bool compressed;
+};
+
+struct config_history {
+    char *filename;                /* The save_path this is the history of. */
+    struct history_entry *entries; /* Oldest first. */
+    size_t nentries;
+    size_t allocated;
+};
+
+void init_config_history(conflate_handle_t *handle) {
+    cb_mutex_initialize(&handle->history_lock);
+    handle->history = NULL;
+}
+
+static bool history_enabled(conflate_handle_t *handle) {
+    const char *path = handle->conf->save_path;
+    return handle->conf->history_max_configs > 0 && path != NULL && *path != '\0';
+}
+
+static char *index_path(struct config_history *history) {
+    size_t len = strlen(history->filename) + sizeof(HISTORY_SUFFIX);
+    char *rv = malloc(len);
+    assert(rv);
+    snprintf(rv, len, "%s" HISTORY_SUFFIX, history->filename);
+    return rv;
+}
+
+static char *config_path(struct config_history *history, uint64_t hash) {
+    size_t len = strlen(history->filename) + sizeof(HISTORY_SUFFIX) + 17;
+    char *rv = malloc(len);
+    assert(rv);
+    snprintf(rv, len, "%s" HISTORY_SUFFIX ".%016llx", history->filename,
+             (unsigned long long) hash);
+    return rv;
+}
+
+static void add_entry(struct config_history *history,
+                      const struct history_entry *entry) {
+    if (history->nentries == history->allocated) {
+        history->allocated = history->allocated ? history->allocated << 1 : 8;
+        history->entries = realloc(history->entries,
+                                   history->allocated * sizeof(struct history_entry));
+        assert(history->entries);
+    }
+    history->entries[history->nentries++] = *entry;
+}
+
+static void remove_entry(struct config_history *history, size_t i) {
+    memmove(history->entries + i, history->entries + i + 1,
+            (history->nentries - i - 1) * sizeof(struct history_entry));
+    history->nentries--;
+}
+
+static void load_index(conflate_handle_t *handle, struct config_history *history) {
+    char *path = index_path(history);
+    FILE *fp = fopen(path, "r");
+    char line[HISTORY_LINE_MAX];
+
+    if (fp != NULL) {
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            struct history_entry entry;
+            unsigned long long hash, size, stored_size, saved_at;
+            char kind;
+
+            if (sscanf(line, "%llx %llu %llu %llu %c", &hash, &size,
+                       &stored_size, &saved_at, &kind) != 5 ||
+                (kind != 'z' && kind != 'r')) {
+                handle->conf->log(handle->conf->userdata, LOG_LVL_WARN,
+                                  "Ignoring a corrupt line in %s", path);
+                continue;
+            }
+            entry.hash = hash;
+            entry.size = size;
+            entry.stored_size = stored_size;
+            entry.saved_at = saved_at;
+            entry.compressed = kind == 'z';
+            add_entry(history, &entry);
+        }
+        fclose(fp);
+    }
+    free(path);
+}
+
+/* Write the index of the entries from first on. */
+static bool save_index(conflate_handle_t *handle, struct config_history *history,
+                       size_t first) {
+    char *path = index_path(history);
+    char *buf = malloc(history->nentries * HISTORY_LINE_MAX + 1);
+    size_t used = 0;
+    size_t i;
+    bool ok;
+
+    assert(buf);
+    for (i = first; i < history->nentries; i++) {
+        const struct history_entry *e = &history->entries[i];
+        used += snprintf(buf + used, HISTORY_LINE_MAX, "%016llx %llu %llu %llu %c\n",
+                         (unsigned long long) e->hash,
+                         (unsigned long long) e->size,
+                         (unsigned long long) e->stored_size,
+                         (unsigned long long) e->saved_at,
+                         e->compressed ? 'z' : 'r');
+    }
+
+    ok = persist_file(handle, path, buf, used, SAVE_REPLACE);
+    free(path);
+    return ok;
+}
+
+/* The handle's history, loading it if needed. */
+static struct config_history *get_history(conflate_handle_t *handle) {
+    struct config_history *history = handle->history;
+
+    if (history && strcmp(history->filename, handle->conf->save_path) == 0) {
+        return history;
+    }
+    if (history) {
+        free(history->entries);
+        free(history->filename);
+        free(history);
+    }
+
+    history = calloc(1, sizeof(struct config_history));
+    assert(history);
+    history->filename = safe_strdup(handle->conf->save_path);
+    conflate_flush_saves(handle);
+    load_index(handle, history);
+    handle->history = history;
+    return history;
+}
+
+/* How many of the oldest configs to drop for the history to fit its
+   limits. */
+static size_t count_trimmed(conflate_handle_t *handle,
+                            struct config_history *history) {
+    uint64_t max_bytes = handle->conf->history_max_bytes;
+    uint64_t total = 0;
+    size_t i, n = 0;
+
+    for (i = 0; i < history->nentries; i++) {
+        total += history->entries[i].stored_size;
+    }
+
+    /* The newest config stays however big it is. */
+    while (history->nentries - n > 1 &&
+           (history->nentries - n > handle->conf->history_max_configs ||
+            (max_bytes > 0 && total > max_bytes))) {
+        total -= history->entries[n].stored_size;
+        n++;
+    }
+    return n;
+}
+
+/* Drop the n oldest configs, which the index no longer names. */
+static void remove_oldest(conflate_handle_t *handle,
+                          struct config_history *history, size_t n) {
+    while (n-- > 0) {
+        char *path = config_path(history, history->entries[0].hash);
+        (void) persist_file(handle, path, NULL, 0, SAVE_REMOVE);
+        free(path);
+        remove_entry(history, 0);
+    }
+}
+
+/* Store an encoded config, deflated if possible, taking ownership of
+   data. */
+static bool store_config(conflate_handle_t *handle, struct config_history *history,
+                         struct history_entry *entry, unsigned char *data) {
+    char *path = config_path(history, entry->hash);
+    unsigned char *stored = data;
+    bool ok;
+
+    entry->stored_size = entry->size;
+    entry->compressed = false;
+#ifdef HAVE_ZLIB
+    {
+        uLongf len = compressBound(entry->size);
+        unsigned char *deflated = malloc(len);
+        assert(deflated);
+        if (compress2(deflated, &len, data, entry->size, Z_BEST_SPEED) == Z_OK &&
+            len < entry->size) {
+            stored = deflated;
+            entry->stored_size = len;
+            entry->compressed = true;
+            free(data);
+        } else {
+            free(deflated);
+        }
+    }
+#endif
+
+    ok = persist_file(handle, path, stored, entry->stored_size, SAVE_REPLACE);
+    free(path);
+    return ok;
+}
+
+void record_config_history(conflate_handle_t *handle, kvpair_t *kv) {
+    struct config_history *history;
+    struct history_entry entry;
+    unsigned char *data;
+    size_t size;
+    size_t i, trimmed;
+    bool ok = true;
+
+    if (!history_enabled(handle)) {
+        return;
+    }
+
+    data = encode_kvpairs(kv, &size);
+    entry.hash = conflate_hash(data, size);
+    entry.size = size;
+    entry.saved_at = (uint64_t) time(NULL);
+
+    cb_mutex_enter(&handle->history_lock);
+    history = get_history(handle);
+
+    for (i = 0; i < history->nentries; i++) {
+        if (history->entries[i].hash == entry.hash) {
+            break;
+        }
+    }
+    if (i < history->nentries) {
+        /* Already stored, it's just current again. */
+        entry.stored_size = history->entries[i].stored_size;
+        entry.compressed = history->entries[i].compressed;
+        remove_entry(history, i);
+        free(data);
+    } else {
+        ok = store_config(handle, history, &entry, data);
+    }
+
+    if (ok) {
+        add_entry(history, &entry);
+        trimmed = count_trimmed(handle, history);
+        ok = save_index(handle, history, trimmed);
+        if (ok) {
+            remove_oldest(handle, history, trimmed);
+        }
+    }
+    cb_mutex_exit(&handle->history_lock);
+
+    if (!ok) {
+        handle->conf->log(handle->conf->userdata, LOG_LVL_ERROR,
+                          "Can not save config history for %s",
+                          handle->conf->save_path);
+    }
+}
+
+size_t conflate_get_history(conflate_handle_t *handle,
+                            conflate_history_entry_t *entries, size_t max) {
+    struct config_history *history;
+    size_t n = 0;
+
+    if (!history_enabled(handle)) {
+        return 0;
+    }
+
+    cb_mutex_enter(&handle->history_lock);
+    history = get_history(handle);
+    while (n < max && n < history->nentries) {
+        const struct history_entry *e = &history->entries[history->nentries - 1 - n];
+        entries[n].hash = e->hash;
+        entries[n].saved_at = e->saved_at;
+        entries[n].size = e->size;
+        entries[n].stored_size = e->stored_size;
+        n++;
+    }
+    cb_mutex_exit(&handle->history_lock);
+
+    return n;
+}
+
+/* Read back a stored config, NULL if it's gone or corrupt. */
+static kvpair_t *load_config(struct config_history *history,
+                             const struct history_entry *entry) {
+    char *path = config_path(history, entry->hash);
+    FILE *fp = fopen(path, "rb");
+    unsigned char *stored;
+    unsigned char *data = NULL;
+    kvpair_t *rv = NULL;
+
+    free(path);
+    if (fp == NULL) {
+        return NULL;
+    }
+
+    stored = malloc(entry->stored_size + 1);
+    assert(stored);
+    if (fread(stored, 1, entry->stored_size + 1, fp) == entry->stored_size) {
+        if (!entry->compressed) {
+            data = stored;
+            stored = NULL;
+        }
+#ifdef HAVE_ZLIB
+        else {
+            uLongf len = entry->size;
+            data = malloc(entry->size);
+            assert(data);
+            if (uncompress(data, &len, stored, entry->stored_size) != Z_OK ||
+                len != entry->size) {
+                free(data);
+                data = NULL;
+            }
+        }
+#endif
+    }
+    fclose(fp);
+
+    if (data != NULL && conflate_hash(data, entry->size) == entry->hash) {
+        rv = decode_kvpairs(data, entry->size);
+    }
+    free(data);
+    free(stored);
+    return rv;
+}
+
+conflate_result conflate_redeliver_config(conflate_handle_t *handle, uint64_t hash) {
+    struct config_history *history;
+    kvpair_t *kv = NULL;
+    size_t i;
+
+    if (!history_enabled(handle)) {
+        return CONFLATE_ERROR;
+    }
+
+    /* The config may still be on its way to disk. */
+    conflate_flush_saves(handle);
+
+    cb_mutex_enter(&handle->history_lock);
+    history = get_history(handle);
+    for (i = 0; i < history->nentries; i++) {
+        if (history->entries[i].hash == hash) {
+            kv = load_config(history, &history->entries[i]);
+            break;
+        }
+    }
+    cb_mutex_exit(&handle->history_lock);
+
+    if (kv == NULL) {
+        handle->conf->log(handle->conf->userdata, LOG_LVL_ERROR,
+                          "No saved config %016llx to roll back to",
+                          (unsigned long long) hash);
+        return CONFLATE_ERROR;
+    }
+
+    handle->conf->log(handle->conf->userdata, LOG_LVL_INFO,
+                      "Rolling back to saved config %016llx",
+                      (unsigned long long) hash);
+    return redeliver_config(handle, kv);
+}
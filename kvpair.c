@@ -4,6 +4,39 @@
 #include <assert.h>
 
 #include "conflate.h"
+#include "conflate_internal.h"
+
+/* The values are owned by someone else (see mk_kvpair_borrowed). */
+#define KVPAIR_BORROWED_VALUES 0x01
+/* The pair lives in a block made by dup_kvpair_packed. */
+#define KVPAIR_PACKED 0x02
+/* ... and is the first pair of that block. */
+#define KVPAIR_PACKED_HEAD 0x04
+
+/*
+ * A packed chain is one allocation: this header, the kvpair_t nodes,
+ * the values arrays and then all the strings.  Views (mk_kvpair_view)
+ * have the same layout but for the strings, which are in a separate
+ * backing buffer.
+ */
+struct kvpair_block {
+    size_t size;
+    size_t npairs;
+    volatile long refcount;  /* See kvpair_retain. */
+    void *backing;
+    size_t backing_size;
+    void (*release_backing)(void *backing, size_t size);
+};
+
+#ifdef WIN32
+#define atomic_incr(p) InterlockedIncrement(p)
+#define atomic_decr(p) InterlockedDecrement(p)
+#else
+#define atomic_incr(p) __sync_add_and_fetch(p, 1)
+#define atomic_decr(p) __sync_sub_and_fetch(p, 1)
+#endif
+
+#define PACKED_BLOCK(head) (((struct kvpair_block *) (head)) - 1)
 
 kvpair_t* mk_kvpair(const char* k, char** v)
 {
@@ -11,24 +44,47 @@ kvpair_t* mk_kvpair(const char* k, char** v)
     assert(rv);
 
     rv->key = safe_strdup(k);
+    /* Allocate even for an empty v so values is always a list. */
+    rv->allocated_values = 4;
+    rv->values = calloc(4, sizeof(char*));
+    assert(rv->values);
     if (v) {
         int i = 0;
         for (i = 0; v[i]; i++) {
             add_kvpair_value(rv, v[i]);
         }
-    } else {
-        rv->allocated_values = 4;
-        rv->values = calloc(4, sizeof(char*));
-        assert(rv->values);
     }
 
     return rv;
 }
 
+kvpair_t* mk_kvpair_borrowed(const char* k, char** v)
+{
+    kvpair_t* rv = calloc(1, sizeof(kvpair_t));
+    int n = 0;
+    assert(rv);
+    assert(v);
+
+    while (v[n]) {
+        n++;
+    }
+
+    rv->key = safe_strdup(k);
+    rv->flags = KVPAIR_BORROWED_VALUES;
+    rv->allocated_values = n + 1;
+    rv->used_values = n;
+    rv->values = calloc(n + 1, sizeof(char*));
+    assert(rv->values);
+    memcpy(rv->values, v, n * sizeof(char*));
+
+    return rv;
+}
+
 void add_kvpair_value(kvpair_t* pair, const char* value)
 {
     assert(pair);
     assert(value);
+    assert((pair->flags & (KVPAIR_BORROWED_VALUES | KVPAIR_PACKED)) == 0);
 
     /* The last item in the values list must be null as it acts a sentinal */
     if (pair->allocated_values == 0 ||
@@ -47,13 +103,40 @@ void add_kvpair_value(kvpair_t* pair, const char* value)
     pair->values[pair->used_values] = 0;
 }
 
+/* The last pair of the packed block starting at head. */
+static kvpair_t *packed_tail(kvpair_t *head)
+{
+    return head + PACKED_BLOCK(head)->npairs - 1;
+}
+
 void free_kvpair(kvpair_t* pair)
 {
-    if (pair) {
-        free_kvpair(pair->next);
-        free(pair->key);
-        free_string_list(pair->values);
-        free(pair);
+    /* Loop rather than recurse, chains can be very long. */
+    while (pair) {
+        kvpair_t *next;
+        if (pair->flags & KVPAIR_PACKED) {
+            /* Only the whole block can go, once nobody else uses it. */
+            assert(pair->flags & KVPAIR_PACKED_HEAD);
+            if (atomic_decr(&PACKED_BLOCK(pair)->refcount) != 0) {
+                return;
+            }
+            next = packed_tail(pair)->next;
+            if (PACKED_BLOCK(pair)->release_backing) {
+                PACKED_BLOCK(pair)->release_backing(PACKED_BLOCK(pair)->backing,
+                                                    PACKED_BLOCK(pair)->backing_size);
+            }
+            free(PACKED_BLOCK(pair));
+        } else {
+            next = pair->next;
+            free(pair->key);
+            if (pair->flags & KVPAIR_BORROWED_VALUES) {
+                free(pair->values);
+            } else {
+                free_string_list(pair->values);
+            }
+            free(pair);
+        }
+        pair = next;
     }
 }
 
@@ -93,13 +176,296 @@ char *get_simple_kvpair_val(kvpair_t *pair, const char *key)
     return rv;
 }
 
+kvpair_t *dup_kvpair_packed(kvpair_t *pair)
+{
+    size_t npairs = 0;
+    size_t nvalues = 0;
+    size_t strings = 0;
+    size_t size;
+    struct kvpair_block *block;
+    kvpair_t *p;
+    kvpair_t *node;
+    char **values;
+    char *str;
+    int i;
+
+    assert(pair);
+
+    for (p = pair; p; p = p->next) {
+        npairs++;
+        nvalues += p->used_values + 1;
+        strings += strlen(p->key) + 1;
+        for (i = 0; i < p->used_values; i++) {
+            strings += strlen(p->values[i]) + 1;
+        }
+    }
+
+    size = sizeof(struct kvpair_block) + npairs * sizeof(kvpair_t) +
+        nvalues * sizeof(char*) + strings;
+    block = malloc(size);
+    assert(block);
+    block->size = size;
+    block->npairs = npairs;
+    block->refcount = 1;
+    block->backing = NULL;
+    block->backing_size = 0;
+    block->release_backing = NULL;
+
+    node = (kvpair_t*) (block + 1);
+    values = (char**) (node + npairs);
+    str = (char*) (values + nvalues);
+
+    for (p = pair; p; p = p->next, node++) {
+        size_t len = strlen(p->key) + 1;
+        memcpy(str, p->key, len);
+        node->key = str;
+        str += len;
+
+        node->values = values;
+        for (i = 0; i < p->used_values; i++) {
+            len = strlen(p->values[i]) + 1;
+            memcpy(str, p->values[i], len);
+            *values++ = str;
+            str += len;
+        }
+        *values++ = NULL;
+
+        node->used_values = p->used_values;
+        node->allocated_values = p->used_values + 1;
+        node->flags = KVPAIR_PACKED;
+        node->next = p->next ? node + 1 : NULL;
+    }
+
+    node = (kvpair_t*) (block + 1);
+    node->flags |= KVPAIR_PACKED_HEAD;
+    return node;
+}
+
+kvpair_t *mk_kvpair_view(size_t npairs, size_t nvalues, char ***values,
+                         void *backing, size_t backing_size,
+                         void (*release)(void *backing, size_t size))
+{
+    size_t size = sizeof(struct kvpair_block) + npairs * sizeof(kvpair_t) +
+        (nvalues + npairs) * sizeof(char*);
+    struct kvpair_block *block;
+    kvpair_t *node;
+    size_t i;
+
+    assert(npairs > 0);
+
+    block = calloc(1, size);
+    assert(block);
+    block->size = size;
+    block->npairs = npairs;
+    block->refcount = 1;
+    block->backing = backing;
+    block->backing_size = backing_size;
+    block->release_backing = release;
+
+    node = (kvpair_t*) (block + 1);
+    for (i = 0; i < npairs; i++) {
+        node[i].flags = KVPAIR_PACKED;
+        node[i].next = i + 1 < npairs ? &node[i + 1] : NULL;
+    }
+    node->flags |= KVPAIR_PACKED_HEAD;
+
+    *values = (char**) (node + npairs);
+    return node;
+}
+
+/* Copy a whole packed chain with one memcpy and rebase its pointers. */
+static kvpair_t *copy_packed_block(kvpair_t *pair)
+{
+    struct kvpair_block *block = PACKED_BLOCK(pair);
+    char *old_base = (char*) block;
+    char *new_base = malloc(block->size);
+    kvpair_t *node;
+    size_t n;
+    int i;
+
+    assert(new_base);
+    memcpy(new_base, old_base, block->size);
+    ((struct kvpair_block *) new_base)->refcount = 1;
+
+#define REBASE(ptr) ((void*) (new_base + ((char*) (ptr) - old_base)))
+    node = (kvpair_t*) (((struct kvpair_block *) new_base) + 1);
+    for (n = 0; n < block->npairs; n++, node++) {
+        node->key = REBASE(node->key);
+        node->values = REBASE(node->values);
+        for (i = 0; i < node->used_values; i++) {
+            node->values[i] = REBASE(node->values[i]);
+        }
+        if (node->next) {
+            node->next = REBASE(node->next);
+        }
+    }
+#undef REBASE
+
+    return (kvpair_t*) (((struct kvpair_block *) new_base) + 1);
+}
+
+kvpair_t *kvpair_retain(kvpair_t *pair)
+{
+    assert(pair);
+
+    if (pair->flags & KVPAIR_PACKED_HEAD) {
+        atomic_incr(&PACKED_BLOCK(pair)->refcount);
+        return pair;
+    }
+    return dup_kvpair_packed(pair);
+}
+
+void kvpair_release(kvpair_t *snapshot)
+{
+    assert(snapshot == NULL || (snapshot->flags & KVPAIR_PACKED_HEAD));
+    free_kvpair(snapshot);
+}
+
 kvpair_t *dup_kvpair(kvpair_t *pair)
 {
-    kvpair_t *copy;
+    kvpair_builder_t builder;
     assert(pair);
-    copy = mk_kvpair(pair->key, pair->values);
-    if (pair->next) {
-        copy->next = dup_kvpair(pair->next);
+
+    /* Views point outside their block, so they're copied pair by pair. */
+    if ((pair->flags & KVPAIR_PACKED_HEAD) && packed_tail(pair)->next == NULL &&
+        PACKED_BLOCK(pair)->backing == NULL) {
+        return copy_packed_block(pair);
+    }
+
+    init_kvpair_builder(&builder);
+    for (; pair; pair = pair->next) {
+        kvpair_builder_add(&builder, pair->key, pair->values);
+    }
+    return kvpair_builder_finish(&builder);
+}
+
+void init_kvpair_builder(kvpair_builder_t *builder)
+{
+    assert(builder);
+    builder->head = NULL;
+    builder->tail = NULL;
+}
+
+kvpair_t *kvpair_builder_add(kvpair_builder_t *builder,
+                             const char *k, char **v)
+{
+    kvpair_t *pair = mk_kvpair(k, v);
+
+    if (builder->tail) {
+        builder->tail->next = pair;
+    } else {
+        builder->head = pair;
+    }
+    builder->tail = pair;
+
+    return pair;
+}
+
+kvpair_t *kvpair_builder_finish(kvpair_builder_t *builder)
+{
+    kvpair_t *rv = builder->head;
+    init_kvpair_builder(builder);
+    return rv;
+}
+
+struct kvpair_index_entry {
+    uint64_t hash;
+    kvpair_t *pair;
+};
+
+struct kvpair_index {
+    kvpair_t *chain;
+    struct kvpair_index_entry *entries; /* NULL until the first lookup. */
+    size_t mask;                        /* Number of entries - 1. */
+};
+
+kvpair_index_t *mk_kvpair_index(kvpair_t *pair)
+{
+    kvpair_index_t *rv = calloc(1, sizeof(kvpair_index_t));
+    assert(rv);
+    rv->chain = pair;
+    return rv;
+}
+
+static void build_kvpair_index(kvpair_index_t *index)
+{
+    size_t n = 0;
+    size_t size = 8;
+    kvpair_t *pair;
+
+    for (pair = index->chain; pair; pair = pair->next) {
+        n++;
+    }
+    /* Keep the table at most half full so probe runs stay short. */
+    while (size < n * 2) {
+        size <<= 1;
+    }
+
+    index->entries = calloc(size, sizeof(struct kvpair_index_entry));
+    assert(index->entries);
+    index->mask = size - 1;
+
+    for (pair = index->chain; pair; pair = pair->next) {
+        uint64_t hash = conflate_hash(pair->key, strlen(pair->key));
+        size_t i = (size_t) hash & index->mask;
+
+        while (index->entries[i].pair != NULL) {
+            /* find_kvpair returns the first match, so keep that one. */
+            if (index->entries[i].hash == hash &&
+                strcmp(index->entries[i].pair->key, pair->key) == 0) {
+                break;
+            }
+            i = (i + 1) & index->mask;
+        }
+        if (index->entries[i].pair == NULL) {
+            index->entries[i].hash = hash;
+            index->entries[i].pair = pair;
+        }
+    }
+}
+
+kvpair_t *find_kvpair_indexed(kvpair_index_t *index, const char *key)
+{
+    uint64_t hash;
+    size_t i;
+
+    assert(index);
+    assert(key);
+
+    if (index->entries == NULL) {
+        build_kvpair_index(index);
+    }
+
+    hash = conflate_hash(key, strlen(key));
+    for (i = (size_t) hash & index->mask; index->entries[i].pair != NULL;
+         i = (i + 1) & index->mask) {
+        if (index->entries[i].hash == hash &&
+            strcmp(index->entries[i].pair->key, key) == 0) {
+            return index->entries[i].pair;
+        }
+    }
+
+    return NULL;
+}
+
+char *get_simple_kvpair_val_indexed(kvpair_index_t *index, const char *key)
+{
+    kvpair_t *found = find_kvpair_indexed(index, key);
+    return found ? found->values[0] : NULL;
+}
+
+void invalidate_kvpair_index(kvpair_index_t *index, kvpair_t *pair)
+{
+    assert(index);
+    free(index->entries);
+    index->entries = NULL;
+    index->chain = pair;
+}
+
+void free_kvpair_index(kvpair_index_t *index)
+{
+    if (index) {
+        free(index->entries);
+        free(index);
     }
-    return copy;
 }
@@ -1,51 +1,845 @@
+/*
+ * Saved configs, so a restarted process has its last good config
+ * before any config server answers.
+ *
+ * The file is a fixed header, two offset tables and the strings:
+ *
+ *   "CNFL" | version | pair count | value count | payload length | hash
+ *   pair count x (key offset | value count)
+ *   value count x value offset
+ *   '\0' terminated keys and values
+ *
+ * with 32 bit fields except the payload length and hash (64 bit), all
+ * little endian.  Offsets are from the start of the file.  The hash
+ * (conflate_hash of everything after the header) lets a torn or
+ * corrupted file be told apart from a config.
+ *
+ * Loading doesn't copy the strings: the pairs are a view
+ * (mk_kvpair_view) pointing into the file's bytes, which
+ * load_kvpairs_mapped maps rather than reads so processes sharing a
+ * saved config share its pages.  The file ends with a '\0', so any
+ * in-bounds offset is a terminated string and checking the tables and
+ * the hash is all the parsing there is.
+ *
+ * Saves go to a temporary file renamed over the old one, so readers
+ * see either the old or the new config, never a mix, and mappings of
+ * the old file stay valid.
+ */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 
+#ifdef WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
 #include "conflate.h"
 #include "conflate_internal.h"
 
+#define PERSIST_MAGIC "CNFL"
+#define PERSIST_VERSION 2
+#define PERSIST_HEADER_SIZE 32
+#define PERSIST_PAIR_SIZE 8
+#define PERSIST_VALUE_SIZE 4
+
+static void put_u32(unsigned char *p, uint32_t v)
+{
+    p[0] = (unsigned char) v;
+    p[1] = (unsigned char) (v >> 8);
+    p[2] = (unsigned char) (v >> 16);
+    p[3] = (unsigned char) (v >> 24);
+}
+
+static void put_u64(unsigned char *p, uint64_t v)
+{
+    put_u32(p, (uint32_t) v);
+    put_u32(p + 4, (uint32_t) (v >> 32));
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 |
+        (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint64_t get_u64(const unsigned char *p)
+{
+    return (uint64_t) get_u32(p) | (uint64_t) get_u32(p + 4) << 32;
+}
+
+/* Append a string to the string section, returning its offset. */
+static uint32_t put_string(unsigned char *buf, size_t *used, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    uint32_t offset = (uint32_t) *used;
+    memcpy(buf + *used, s, len);
+    *used += len;
+    return offset;
+}
+
+unsigned char *encode_kvpairs(kvpair_t *pairs, size_t *size)
+{
+    size_t strings = 1;
+    uint32_t npairs = 0;
+    uint32_t nvalues = 0;
+    unsigned char *buf;
+    unsigned char *pair_table;
+    unsigned char *value_table;
+    size_t used;
+    kvpair_t *pair;
+    int i;
+
+    for (pair = pairs; pair; pair = pair->next) {
+        npairs++;
+        strings += strlen(pair->key) + 1;
+        for (i = 0; pair->values[i]; i++) {
+            nvalues++;
+            strings += strlen(pair->values[i]) + 1;
+        }
+    }
+
+    *size = PERSIST_HEADER_SIZE + (size_t) npairs * PERSIST_PAIR_SIZE +
+        (size_t) nvalues * PERSIST_VALUE_SIZE + strings;
+    /* Offsets are 32 bit. */
+    assert(*size <= UINT32_MAX);
+    buf = malloc(*size);
+    assert(buf);
+
+    pair_table = buf + PERSIST_HEADER_SIZE;
+    value_table = pair_table + (size_t) npairs * PERSIST_PAIR_SIZE;
+    used = value_table - buf + (size_t) nvalues * PERSIST_VALUE_SIZE;
+
+    for (pair = pairs; pair; pair = pair->next) {
+        put_u32(pair_table, put_string(buf, &used, pair->key));
+        for (i = 0; pair->values[i]; i++) {
+            put_u32(value_table, put_string(buf, &used, pair->values[i]));
+            value_table += PERSIST_VALUE_SIZE;
+        }
+        put_u32(pair_table + 4, i);
+        pair_table += PERSIST_PAIR_SIZE;
+    }
+    /* The final '\0' that bounds every string, see parse_kvpairs. */
+    buf[used++] = '\0';
+    assert(used == *size);
+
+    memcpy(buf, PERSIST_MAGIC, 4);
+    put_u32(buf + 4, PERSIST_VERSION);
+    put_u32(buf + 8, npairs);
+    put_u32(buf + 12, nvalues);
+    put_u64(buf + 16, *size - PERSIST_HEADER_SIZE);
+    put_u64(buf + 24, conflate_hash(buf + PERSIST_HEADER_SIZE,
+                                    *size - PERSIST_HEADER_SIZE));
+
+    return buf;
+}
+
+/*
+ * Make a view of the saved config in buf, which the view owns (see
+ * mk_kvpair_view) if it's returned.
+ */
+static kvpair_t *parse_kvpairs(const unsigned char *buf, size_t size,
+                               void (*release)(void *backing, size_t size))
+{
+    const unsigned char *pair_table = buf + PERSIST_HEADER_SIZE;
+    const unsigned char *value_table;
+    size_t strings;
+    uint32_t npairs, nvalues, total;
+    uint32_t i, j;
+    char **slots;
+    kvpair_t *rv;
+    kvpair_t *pair;
+
+    if (size < PERSIST_HEADER_SIZE + 1 ||
+        memcmp(buf, PERSIST_MAGIC, 4) != 0 ||
+        get_u32(buf + 4) != PERSIST_VERSION ||
+        get_u64(buf + 16) != size - PERSIST_HEADER_SIZE ||
+        buf[size - 1] != '\0') {
+        return NULL;
+    }
+    /* A torn write or flipped bit can leave the tables intact, so
+       check the strings too even if that reads every byte. */
+    if (get_u64(buf + 24) != conflate_hash(buf + PERSIST_HEADER_SIZE,
+                                           size - PERSIST_HEADER_SIZE)) {
+        return NULL;
+    }
+
+    npairs = get_u32(buf + 8);
+    nvalues = get_u32(buf + 12);
+    if (npairs > (size - PERSIST_HEADER_SIZE) / PERSIST_PAIR_SIZE ||
+        nvalues > (size - PERSIST_HEADER_SIZE) / PERSIST_VALUE_SIZE) {
+        return NULL;
+    }
+    value_table = pair_table + (size_t) npairs * PERSIST_PAIR_SIZE;
+    strings = value_table - buf + (size_t) nvalues * PERSIST_VALUE_SIZE;
+    if (strings >= size) {
+        return NULL;
+    }
+
+    /* Every offset must land in the strings. */
+    total = 0;
+    for (i = 0; i < npairs; i++) {
+        uint32_t key = get_u32(pair_table + i * PERSIST_PAIR_SIZE);
+        uint32_t n = get_u32(pair_table + i * PERSIST_PAIR_SIZE + 4);
+        if (key < strings || key >= size || n > nvalues - total) {
+            return NULL;
+        }
+        total += n;
+    }
+    if (npairs == 0 || total != nvalues) {
+        return NULL;
+    }
+    for (i = 0; i < nvalues; i++) {
+        uint32_t value = get_u32(value_table + i * PERSIST_VALUE_SIZE);
+        if (value < strings || value >= size) {
+            return NULL;
+        }
+    }
+
+    rv = mk_kvpair_view(npairs, nvalues, &slots, (void*) buf, size, release);
+    pair = rv;
+    for (i = 0; i < npairs; i++, pair = pair->next) {
+        uint32_t n = get_u32(pair_table + 4);
+
+        pair->key = (char *) buf + get_u32(pair_table);
+        pair_table += PERSIST_PAIR_SIZE;
+        pair->values = slots;
+        for (j = 0; j < n; j++) {
+            slots[j] = (char *) buf + get_u32(value_table);
+            value_table += PERSIST_VALUE_SIZE;
+        }
+        slots[n] = NULL;
+        slots += n + 1;
+        pair->used_values = n;
+        pair->allocated_values = n + 1;
+    }
+
+    return rv;
+}
+
+kvpair_t *decode_kvpairs(const unsigned char *buf, size_t size)
+{
+    kvpair_t *view = parse_kvpairs(buf, size, NULL);
+    kvpair_t *rv = NULL;
+    if (view) {
+        rv = dup_kvpair_packed(view);
+        free_kvpair(view);
+    }
+    return rv;
+}
+
+static void free_backing(void *backing, size_t size)
+{
+    (void)size;
+    free(backing);
+}
+
 kvpair_t* load_kvpairs(conflate_handle_t *handle, const char *filename)
 {
-    (void)handle;
-    (void)filename;
-    return NULL;
+    FILE *fp;
+    unsigned char *buf;
+    long size;
+    kvpair_t *rv = NULL;
+
+    fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        return NULL;
+    }
+
+    if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < 0 ||
+        fseek(fp, 0, SEEK_SET) != 0) {
+        fclose(fp);
+        return NULL;
+    }
+
+    buf = malloc(size > 0 ? size : 1);
+    assert(buf);
+    if (fread(buf, 1, size, fp) == (size_t) size) {
+        rv = parse_kvpairs(buf, size, free_backing);
+        if (rv == NULL) {
+            handle->conf->log(handle->conf->userdata, LOG_LVL_WARN,
+                              "Ignoring corrupt saved config %s", filename);
+        }
+    }
+    if (rv == NULL) {
+        free(buf);
+    }
+    fclose(fp);
+
+    return rv;
+}
+
+#ifdef WIN32
+kvpair_t* load_kvpairs_mapped(conflate_handle_t *handle, const char *filename)
+{
+    return load_kvpairs(handle, filename);
+}
+#else
+static void unmap_backing(void *backing, size_t size)
+{
+    munmap(backing, size);
+}
+
+kvpair_t* load_kvpairs_mapped(conflate_handle_t *handle, const char *filename)
+{
+    int fd;
+    struct stat st;
+    void *map;
+    kvpair_t *rv;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+
+    /* Callbacks may edit delivered values in place, so the mapping is
+       copy-on-write: pages nobody touches are still shared, and the
+       file (only ever replaced, never rewritten) is left alone. */
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    rv = parse_kvpairs(map, st.st_size, unmap_backing);
+    if (rv == NULL) {
+        handle->conf->log(handle->conf->userdata, LOG_LVL_WARN,
+                          "Ignoring corrupt saved config %s", filename);
+        munmap(map, st.st_size);
+    }
+
+    return rv;
+}
+#endif
+
+/* Flush a written file (or directory) to stable storage. */
+static bool sync_fd(int fd)
+{
+#ifdef WIN32
+    return _commit(fd) == 0;
+#else
+    return fsync(fd) == 0;
+#endif
+}
+
+#ifndef WIN32
+/* Make the rename itself durable. */
+static void sync_parent_dir(const char *filename)
+{
+    char *dir = safe_strdup(filename);
+    char *slash = strrchr(dir, '/');
+    int fd;
+
+    if (slash == NULL) {
+        strcpy(dir, ".");
+    } else if (slash == dir) {
+        dir[1] = '\0';
+    } else {
+        *slash = '\0';
+    }
+
+    fd = open(dir, O_RDONLY);
+    if (fd >= 0) {
+        sync_fd(fd);
+        close(fd);
+    }
+    free(dir);
+}
+#endif
+
+/* Account for a save taking total ns, fsync_ns of them in fsync. */
+static void count_save(conflate_handle_t *handle, bool ok,
+                       hrtime_t total, hrtime_t fsync_ns)
+{
+    conflate_stats_t *stats = &handle->stats;
+    uint64_t write_ns = total - fsync_ns;
+
+    cb_mutex_enter(&handle->stats_lock);
+    if (ok) {
+        stats->saves_written++;
+    } else {
+        stats->saves_failed++;
+    }
+    stats->save_write_ns += write_ns;
+    if (write_ns > stats->save_write_max_ns) {
+        stats->save_write_max_ns = write_ns;
+    }
+    stats->save_fsync_ns += fsync_ns;
+    if (fsync_ns > stats->save_fsync_max_ns) {
+        stats->save_fsync_max_ns = fsync_ns;
+    }
+    cb_mutex_exit(&handle->stats_lock);
+}
+
+bool write_file_atomically(conflate_handle_t *handle, const char *filename,
+                           const void *data, size_t size)
+{
+    size_t len = strlen(filename) + sizeof(".tmp");
+    char *tmp = malloc(len);
+    hrtime_t start = gethrtime();
+    hrtime_t fsync_ns = 0;
+    hrtime_t t;
+    FILE *fp;
+    bool ok;
+
+    assert(tmp);
+    snprintf(tmp, len, "%s.tmp", filename);
+
+    fp = fopen(tmp, "wb");
+    if (fp == NULL) {
+        free(tmp);
+        count_save(handle, false, gethrtime() - start, 0);
+        return false;
+    }
+
+    ok = fwrite(data, 1, size, fp) == size && fflush(fp) == 0;
+    if (ok && handle->conf->fsync_saves) {
+        t = gethrtime();
+        ok = sync_fd(fileno(fp));
+        fsync_ns += gethrtime() - t;
+    }
+    ok = fclose(fp) == 0 && ok;
+
+#ifdef WIN32
+    ok = ok && MoveFileEx(tmp, filename, MOVEFILE_REPLACE_EXISTING);
+#else
+    ok = ok && rename(tmp, filename) == 0;
+    if (ok && handle->conf->fsync_saves) {
+        t = gethrtime();
+        sync_parent_dir(filename);
+        fsync_ns += gethrtime() - t;
+    }
+#endif
+
+    if (!ok) {
+        remove(tmp);
+    }
+    free(tmp);
+    count_save(handle, ok, gethrtime() - start, fsync_ns);
+    return ok;
+}
+
+bool append_file(conflate_handle_t *handle, const char *filename,
+                 const void *data, size_t size)
+{
+    hrtime_t start = gethrtime();
+    hrtime_t fsync_ns = 0;
+    FILE *fp = fopen(filename, "ab");
+    bool ok;
+
+    if (fp == NULL) {
+        count_save(handle, false, gethrtime() - start, 0);
+        return false;
+    }
+
+    ok = fwrite(data, 1, size, fp) == size && fflush(fp) == 0;
+    if (ok && handle->conf->fsync_saves) {
+        hrtime_t t = gethrtime();
+        ok = sync_fd(fileno(fp));
+        fsync_ns = gethrtime() - t;
+    }
+    ok = fclose(fp) == 0 && ok;
+
+    count_save(handle, ok, gethrtime() - start, fsync_ns);
+    return ok;
 }
 
 bool save_kvpairs(conflate_handle_t *handle, kvpair_t* kvpair,
                   const char *filename)
 {
-    (void)handle;
-    (void)kvpair;
-    (void)filename;
+    size_t size;
+    unsigned char *buf = encode_kvpairs(kvpair, &size);
+    return persist_file(handle, filename, buf, size, SAVE_REPLACE);
+}
+
+/*
+ * Instance-private data (conflate_save_private and friends) lives in
+ * an append-only log next to the saved config, at <save_path>.private:
+ *
+ *   "CNFP" | version
+ *   records: hash | key length | value length | key | value
+ *
+ * with the lengths 32 bit, the hash (conflate_hash of the rest of the
+ * record) 64 bit, all little endian.  A value length of
+ * PRIVATE_TOMBSTONE deletes the key.  The log is replayed into a hash
+ * table on first use, so gets don't touch the file and sets and
+ * deletes are one append.  Replay stops at the first bad record (a
+ * torn append); the log is rewritten from the table before anything
+ * is appended after it, and whenever it's grown to more than twice
+ * the size its live records need.
+ *
+ * The store belongs to its handle, so only one process should use a
+ * save_path's private data at a time.
+ */
+#define PRIVATE_SUFFIX ".private"
+#define PRIVATE_MAGIC "CNFP"
+#define PRIVATE_VERSION 1
+#define PRIVATE_HEADER_SIZE 8
+#define PRIVATE_RECORD_SIZE 16
+#define PRIVATE_TOMBSTONE UINT32_MAX
+#define PRIVATE_COMPACT_MIN 65536
+
+struct private_entry {
+    char *key;
+    char *value;
+    uint64_t hash;
+    struct private_entry *next;
+};
+
+struct private_store {
+    char *filename;          /* The save_path this is the data of. */
+    char *path;              /* The log. */
+    bool rewrite;            /* The log is missing or ends in garbage. */
+    struct private_entry **buckets;
+    size_t nbuckets;
+    size_t nentries;
+    uint64_t live_bytes;     /* What the entries take in the log. */
+    uint64_t log_bytes;
+};
+
+void init_private_store(conflate_handle_t *handle)
+{
+    cb_mutex_initialize(&handle->private_lock);
+    handle->private_store = NULL;
+}
+
+static uint64_t record_size(const char *key, const char *value)
+{
+    return PRIVATE_RECORD_SIZE + strlen(key) + (value ? strlen(value) : 0);
+}
+
+static struct private_entry **find_private(struct private_store *store,
+                                          const char *key, uint64_t hash)
+{
+    struct private_entry **pp = &store->buckets[hash & (store->nbuckets - 1)];
+    while (*pp && ((*pp)->hash != hash || strcmp((*pp)->key, key) != 0)) {
+        pp = &(*pp)->next;
+    }
+    return pp;
+}
+
+static void grow_private(struct private_store *store)
+{
+    size_t nbuckets = store->nbuckets << 1;
+    struct private_entry **buckets = calloc(nbuckets, sizeof(*buckets));
+    size_t i;
+
+    assert(buckets);
+    for (i = 0; i < store->nbuckets; i++) {
+        struct private_entry *e = store->buckets[i];
+        while (e) {
+            struct private_entry *next = e->next;
+            e->next = buckets[e->hash & (nbuckets - 1)];
+            buckets[e->hash & (nbuckets - 1)] = e;
+            e = next;
+        }
+    }
+    free(store->buckets);
+    store->buckets = buckets;
+    store->nbuckets = nbuckets;
+}
+
+/* Set key to value, or remove it if value is NULL. */
+static void set_private(struct private_store *store,
+                        const char *key, const char *value)
+{
+    uint64_t hash = conflate_hash(key, strlen(key));
+    struct private_entry **pp = find_private(store, key, hash);
+    struct private_entry *e = *pp;
+
+    if (e) {
+        store->live_bytes -= record_size(e->key, e->value);
+        if (value == NULL) {
+            *pp = e->next;
+            store->nentries--;
+            free(e->key);
+            free(e->value);
+            free(e);
+            return;
+        }
+        free(e->value);
+        e->value = safe_strdup(value);
+    } else {
+        if (value == NULL) {
+            return;
+        }
+        e = calloc(1, sizeof(struct private_entry));
+        assert(e);
+        e->key = safe_strdup(key);
+        e->value = safe_strdup(value);
+        e->hash = hash;
+        e->next = *pp;
+        *pp = e;
+        if (++store->nentries > store->nbuckets) {
+            grow_private(store);
+        }
+    }
+    store->live_bytes += record_size(key, value);
+}
+
+/* Append a record for key (a tombstone if value is NULL) to buf. */
+static size_t put_private_record(unsigned char *buf,
+                                 const char *key, const char *value)
+{
+    uint32_t klen = (uint32_t) strlen(key);
+    uint32_t vlen = value ? (uint32_t) strlen(value) : 0;
+    size_t size = PRIVATE_RECORD_SIZE + klen + vlen;
+
+    put_u32(buf + 8, klen);
+    put_u32(buf + 12, value ? vlen : PRIVATE_TOMBSTONE);
+    memcpy(buf + PRIVATE_RECORD_SIZE, key, klen);
+    if (value) {
+        memcpy(buf + PRIVATE_RECORD_SIZE + klen, value, vlen);
+    }
+    put_u64(buf, conflate_hash(buf + 8, size - 8));
+    return size;
+}
+
+/* Replay the log, returning how many of its bytes were good records. */
+static uint64_t replay_private(struct private_store *store,
+                               const unsigned char *buf, size_t size)
+{
+    size_t off = PRIVATE_HEADER_SIZE;
+
+    if (size < PRIVATE_HEADER_SIZE ||
+        memcmp(buf, PRIVATE_MAGIC, 4) != 0 ||
+        get_u32(buf + 4) != PRIVATE_VERSION) {
+        return 0;
+    }
+
+    while (size - off >= PRIVATE_RECORD_SIZE) {
+        const unsigned char *rec = buf + off;
+        uint32_t klen = get_u32(rec + 8);
+        uint32_t vlen = get_u32(rec + 12);
+        size_t len = (vlen == PRIVATE_TOMBSTONE) ? 0 : vlen;
+        char *key;
+        char *value = NULL;
+
+        if (klen > size - off - PRIVATE_RECORD_SIZE ||
+            len > size - off - PRIVATE_RECORD_SIZE - klen ||
+            get_u64(rec) != conflate_hash(rec + 8,
+                                          PRIVATE_RECORD_SIZE - 8 + klen + len)) {
+            break;
+        }
+
+        key = malloc(klen + 1);
+        assert(key);
+        memcpy(key, rec + PRIVATE_RECORD_SIZE, klen);
+        key[klen] = '\0';
+        if (vlen != PRIVATE_TOMBSTONE) {
+            value = malloc(len + 1);
+            assert(value);
+            memcpy(value, rec + PRIVATE_RECORD_SIZE + klen, len);
+            value[len] = '\0';
+        }
+        set_private(store, key, value);
+        free(key);
+        free(value);
+
+        off += PRIVATE_RECORD_SIZE + klen + len;
+    }
+
+    return off;
+}
+
+static void load_private(conflate_handle_t *handle, struct private_store *store)
+{
+    FILE *fp = fopen(store->path, "rb");
+    unsigned char *buf;
+    long size;
+
+    store->rewrite = true;
+    if (fp == NULL) {
+        return;
+    }
+
+    if (fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) >= 0 &&
+        fseek(fp, 0, SEEK_SET) == 0) {
+        buf = malloc(size > 0 ? size : 1);
+        assert(buf);
+        if (fread(buf, 1, size, fp) == (size_t) size) {
+            store->log_bytes = replay_private(store, buf, size);
+            store->rewrite = store->log_bytes != (uint64_t) size;
+            if (store->rewrite) {
+                handle->conf->log(handle->conf->userdata, LOG_LVL_WARN,
+                                  "Ignoring the corrupt end of %s", store->path);
+            }
+        }
+        free(buf);
+    }
+    fclose(fp);
+}
+
+static void free_private_store(struct private_store *store)
+{
+    size_t i;
+
+    if (store == NULL) {
+        return;
+    }
+    for (i = 0; i < store->nbuckets; i++) {
+        struct private_entry *e = store->buckets[i];
+        while (e) {
+            struct private_entry *next = e->next;
+            free(e->key);
+            free(e->value);
+            free(e);
+            e = next;
+        }
+    }
+    free(store->buckets);
+    free(store->filename);
+    free(store->path);
+    free(store);
+}
+
+/* The handle's store for filename, loading it if needed. */
+static struct private_store *get_private_store(conflate_handle_t *handle,
+                                               const char *filename)
+{
+    struct private_store *store = handle->private_store;
+    size_t len;
+
+    if (store && strcmp(store->filename, filename) == 0) {
+        return store;
+    }
+    free_private_store(store);
+
+    store = calloc(1, sizeof(struct private_store));
+    assert(store);
+    store->filename = safe_strdup(filename);
+    len = strlen(filename) + sizeof(PRIVATE_SUFFIX);
+    store->path = malloc(len);
+    assert(store->path);
+    snprintf(store->path, len, "%s" PRIVATE_SUFFIX, filename);
+    store->nbuckets = 16;
+    store->buckets = calloc(store->nbuckets, sizeof(*store->buckets));
+    assert(store->buckets);
+
+    /* The log on disk may be behind a store being replaced. */
+    conflate_flush_saves(handle);
+    load_private(handle, store);
+    handle->private_store = store;
+    return store;
+}
+
+/* Rewrite the log with just the live entries. */
+static bool compact_private(conflate_handle_t *handle,
+                            struct private_store *store)
+{
+    size_t size = PRIVATE_HEADER_SIZE + store->live_bytes;
+    unsigned char *buf = malloc(size);
+    size_t off = PRIVATE_HEADER_SIZE;
+    size_t i;
+
+    assert(buf);
+    memcpy(buf, PRIVATE_MAGIC, 4);
+    put_u32(buf + 4, PRIVATE_VERSION);
+    for (i = 0; i < store->nbuckets; i++) {
+        struct private_entry *e;
+        for (e = store->buckets[i]; e; e = e->next) {
+            off += put_private_record(buf + off, e->key, e->value);
+        }
+    }
+    assert(off == size);
+
+    if (!persist_file(handle, store->path, buf, size, SAVE_REPLACE)) {
+        return false;
+    }
+    store->log_bytes = size;
+    store->rewrite = false;
+    return true;
+}
+
+/* Log a set (or a delete if value is NULL) and apply it. */
+static bool append_private(conflate_handle_t *handle,
+                           struct private_store *store,
+                           const char *key, const char *value)
+{
+    unsigned char *buf;
+    size_t size;
+
+    if (save_failed(handle, store->path)) {
+        /* The save writer left garbage, or nothing, at the end. */
+        store->rewrite = true;
+    }
+    if (store->rewrite && !compact_private(handle, store)) {
+        return false;
+    }
+
+    buf = malloc(record_size(key, value));
+    assert(buf);
+    size = put_private_record(buf, key, value);
+    if (!persist_file(handle, store->path, buf, size, SAVE_APPEND)) {
+        /* Whatever made it out is garbage now. */
+        store->rewrite = true;
+        return false;
+    }
+
+    store->log_bytes += size;
+    set_private(store, key, value);
+
+    if (store->log_bytes > PRIVATE_COMPACT_MIN &&
+        store->log_bytes > 2 * (PRIVATE_HEADER_SIZE + store->live_bytes)) {
+        /* The change is logged either way. */
+        compact_private(handle, store);
+    }
     return true;
 }
 
 bool conflate_delete_private(conflate_handle_t *handle,
                              const char *k, const char *filename)
 {
-    (void)handle;
-    (void)k;
-    (void)filename;
-    return true;
+    struct private_store *store;
+    bool ok = true;
+
+    cb_mutex_enter(&handle->private_lock);
+    store = get_private_store(handle, filename);
+    if (*find_private(store, k, conflate_hash(k, strlen(k)))) {
+        ok = append_private(handle, store, k, NULL);
+    }
+    cb_mutex_exit(&handle->private_lock);
+
+    return ok;
 }
 
 bool conflate_save_private(conflate_handle_t *handle,
                            const char *k, const char *v, const char *filename)
 {
-    (void)handle;
-    (void)k;
-    (void)v;
-    (void)filename;
-    return true;
+    bool ok;
+
+    cb_mutex_enter(&handle->private_lock);
+    ok = append_private(handle, get_private_store(handle, filename), k, v);
+    cb_mutex_exit(&handle->private_lock);
+
+    return ok;
 }
 
 char *conflate_get_private(conflate_handle_t *handle,
                            const char *k, const char *filename)
 {
-    (void)handle;
-    (void)k;
-    (void)filename;
-    return NULL;
+    struct private_store *store;
+    struct private_entry *e;
+    char *rv = NULL;
+
+    cb_mutex_enter(&handle->private_lock);
+    store = get_private_store(handle, filename);
+    e = *find_private(store, k, conflate_hash(k, strlen(k)));
+    if (e) {
+        rv = safe_strdup(e->value);
+    }
+    cb_mutex_exit(&handle->private_lock);
+
+    return rv;
 }
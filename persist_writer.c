@@ -0,0 +1,292 @@
+/*
+ * Writing saved state (configs, private data, history) off the thread
+ * that produced it (conflate_config_t.async_saves), so a slow disk
+ * doesn't hold up the next config.
+ *
+ * Writes are queued per file.  A write to a file that's already
+ * queued merges with the pending one (a replacement or removal drops
+ * it, an append extends it) and moves it to the back of the queue, so
+ * a file is never written before something queued ahead of its newest
+ * contents.  The exception is an append after a removal, queued as
+ * its own write behind it so the file is gone before it's recreated.  Each write remembers the oldest request it carries;
+ * conflate_flush_saves() waits for every write carrying a request
+ * made before it was called.
+ *
+ * A failed write may leave a torn append at the end of a file, which
+ * later appends mustn't follow.  The writer remembers the file, drops
+ * appends to it until a replacement is written, and tells the next
+ * save_failed() caller so it can queue one.
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "conflate.h"
+#include "conflate_internal.h"
+
+struct save_job {
+    char *filename;
+    unsigned char *data;
+    size_t size;
+    enum save_op op;
+    uint64_t first_seq;  /* The oldest request merged into this one. */
+    struct save_job *next;
+};
+
+struct save_failure {
+    char *filename;
+    bool reported;       /* save_failed() said so already. */
+    struct save_failure *next;
+};
+
+static struct save_failure **find_failure(conflate_handle_t *handle,
+                                          const char *filename) {
+    struct save_failure **pp = &handle->save_failures;
+    while (*pp && strcmp((*pp)->filename, filename) != 0) {
+        pp = &(*pp)->next;
+    }
+    return pp;
+}
+
+/* Note how a write went; called with save_lock held. */
+static void track_failure(conflate_handle_t *handle, struct save_job *job,
+                          bool ok) {
+    struct save_failure **pp = find_failure(handle, job->filename);
+    struct save_failure *f = *pp;
+
+    if (!ok) {
+        if (f == NULL) {
+            f = calloc(1, sizeof(struct save_failure));
+            assert(f);
+            f->filename = safe_strdup(job->filename);
+            *pp = f;
+        }
+        f->reported = false;
+    } else if (f != NULL && job->op != SAVE_APPEND) {
+        /* The file was written afresh. */
+        *pp = f->next;
+        free(f->filename);
+        free(f);
+    }
+}
+
+static void free_job(struct save_job *job) {
+    free(job->filename);
+    free(job->data);
+    free(job);
+}
+
+static bool run_save(conflate_handle_t *handle, const char *filename,
+                     const void *data, size_t size, enum save_op op) {
+    switch (op) {
+    case SAVE_REPLACE:
+        return write_file_atomically(handle, filename, data, size);
+    case SAVE_APPEND:
+        return append_file(handle, filename, data, size);
+    case SAVE_REMOVE:
+        /* Already gone is fine. */
+        (void) remove(filename);
+        return true;
+    }
+    return false;
+}
+
+static void run_save_writer(void *arg) {
+    conflate_handle_t *handle = (conflate_handle_t *) arg;
+    struct save_job *job;
+    bool skip, ok;
+
+    cb_mutex_enter(&handle->save_lock);
+    for (;;) {
+        while (handle->save_queue == NULL && !handle->save_stopping) {
+            cb_cond_wait(&handle->save_cond, &handle->save_lock);
+        }
+        if (handle->save_queue == NULL) {
+            break;
+        }
+        job = handle->save_queue;
+        handle->save_queue = job->next;
+        handle->save_busy_seq = job->first_seq;
+        skip = job->op == SAVE_APPEND &&
+            *find_failure(handle, job->filename) != NULL;
+        cb_mutex_exit(&handle->save_lock);
+
+        ok = skip ||
+            run_save(handle, job->filename, job->data, job->size, job->op);
+        if (!ok) {
+            handle->conf->log(handle->conf->userdata, LOG_LVL_ERROR,
+                              "Can not save %s", job->filename);
+        }
+
+        cb_mutex_enter(&handle->save_lock);
+        if (!skip) {
+            track_failure(handle, job, ok);
+        }
+        free_job(job);
+        handle->save_busy_seq = 0;
+        cb_cond_broadcast(&handle->saved_cond);
+    }
+
+    handle->save_stopping = false;
+    cb_cond_broadcast(&handle->saved_cond);
+    cb_mutex_exit(&handle->save_lock);
+}
+
+bool start_save_writer(conflate_handle_t *handle) {
+    cb_mutex_initialize(&handle->save_lock);
+    cb_cond_initialize(&handle->save_cond);
+    cb_cond_initialize(&handle->saved_cond);
+    handle->save_queue = NULL;
+    handle->save_failures = NULL;
+    handle->save_seq = 0;
+    handle->save_busy_seq = 0;
+    handle->save_stopping = false;
+
+    if (cb_create_thread(&handle->save_thread, run_save_writer,
+                         handle, 1) != 0) {
+        perror("Failed to create save writer thread");
+        return false;
+    }
+    handle->saves_started = true;
+    return true;
+}
+
+void stop_save_writer(conflate_handle_t *handle) {
+    cb_mutex_enter(&handle->save_lock);
+    handle->save_stopping = true;
+    cb_cond_signal(&handle->save_cond);
+    while (handle->save_stopping) {
+        cb_cond_wait(&handle->saved_cond, &handle->save_lock);
+    }
+    handle->saves_started = false;
+    cb_mutex_exit(&handle->save_lock);
+}
+
+bool persist_file(conflate_handle_t *handle, const char *filename,
+                  void *data, size_t size, enum save_op op) {
+    struct save_job **pp;
+    struct save_job **newest = NULL;
+    struct save_job *job = NULL;
+    uint64_t first_seq;
+    bool merged = false;
+    bool ok;
+
+    if (!handle->saves_started) {
+        ok = run_save(handle, filename, data, size, op);
+        free(data);
+        return ok;
+    }
+
+    cb_mutex_enter(&handle->save_lock);
+    first_seq = ++handle->save_seq;
+
+    if (op == SAVE_APPEND) {
+        /* Appending to what's pending still makes it one write, unless
+           that's a removal. */
+        for (pp = &handle->save_queue; *pp; pp = &(*pp)->next) {
+            if (strcmp((*pp)->filename, filename) == 0) {
+                newest = pp;
+            }
+        }
+        if (newest != NULL && (*newest)->op != SAVE_REMOVE) {
+            job = *newest;
+            *newest = job->next;
+            job->data = realloc(job->data, job->size + size);
+            assert(job->data);
+            memcpy(job->data + job->size, data, size);
+            job->size += size;
+            free(data);
+            merged = true;
+        }
+    } else {
+        /* A replacement or removal drops whatever is pending, taking
+           over the oldest request it carried. */
+        pp = &handle->save_queue;
+        while (*pp) {
+            struct save_job *old = *pp;
+            if (strcmp(old->filename, filename) == 0) {
+                *pp = old->next;
+                if (old->first_seq < first_seq) {
+                    first_seq = old->first_seq;
+                }
+                free_job(old);
+                merged = true;
+            } else {
+                pp = &old->next;
+            }
+        }
+    }
+
+    if (job == NULL) {
+        job = calloc(1, sizeof(struct save_job));
+        assert(job);
+        job->filename = safe_strdup(filename);
+        job->first_seq = first_seq;
+        job->data = data;
+        job->size = size;
+        job->op = op;
+    }
+
+    job->next = NULL;
+    for (pp = &handle->save_queue; *pp; pp = &(*pp)->next) {
+    }
+    *pp = job;
+    cb_cond_signal(&handle->save_cond);
+    cb_mutex_exit(&handle->save_lock);
+
+    if (merged) {
+        cb_mutex_enter(&handle->stats_lock);
+        handle->stats.saves_coalesced++;
+        cb_mutex_exit(&handle->stats_lock);
+    }
+    return true;
+}
+
+bool save_failed(conflate_handle_t *handle, const char *filename) {
+    struct save_failure *f;
+    bool rv = false;
+
+    if (!handle->saves_started) {
+        return false;
+    }
+
+    cb_mutex_enter(&handle->save_lock);
+    f = *find_failure(handle, filename);
+    if (f != NULL && !f->reported) {
+        f->reported = true;
+        rv = true;
+    }
+    cb_mutex_exit(&handle->save_lock);
+    return rv;
+}
+
+/* Whether anything queued up to seq is still to be written. */
+static bool saves_pending(conflate_handle_t *handle, uint64_t seq) {
+    struct save_job *job;
+
+    if (handle->save_busy_seq != 0 && handle->save_busy_seq <= seq) {
+        return true;
+    }
+    for (job = handle->save_queue; job; job = job->next) {
+        if (job->first_seq <= seq) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void conflate_flush_saves(conflate_handle_t *handle) {
+    uint64_t seq;
+
+    if (!handle->saves_started) {
+        return;
+    }
+
+    cb_mutex_enter(&handle->save_lock);
+    seq = handle->save_seq;
+    while (saves_pending(handle, seq)) {
+        cb_cond_wait(&handle->saved_cond, &handle->save_lock);
+    }
+    cb_mutex_exit(&handle->save_lock);
+}
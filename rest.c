@@ -7,14 +7,21 @@
 #include <winsock2.h>
 typedef unsigned int socklen_t;
 #pragma warning (disable:4996)
-#define sleep(a) Sleep(a * 1000)
+#define strncasecmp _strnicmp
 #else
 #include <unistd.h>
+#include <time.h>
+#include <strings.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #endif
 
 #include <string.h>
 #include <curl/curl.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 #include "conflate.h"
 #include "rest.h"
@@ -22,194 +29,523 @@ typedef unsigned int socklen_t;
 
 long curl_init_flags = CURL_GLOBAL_ALL;
 
-static int g_tot_process_new_configs = 0;
-
-struct response_buffer {
-    char *data;
-    size_t bytes_used;
-    size_t buffer_size;
-    struct response_buffer *next;
-};
-
-struct response_buffer *response_buffer_head = NULL;
-struct response_buffer *cur_response_buffer = NULL;
-
-static struct response_buffer *mk_response_buffer(size_t size) {
-    struct response_buffer *r =
-      (struct response_buffer *) calloc(1, sizeof(struct response_buffer));
-    assert(r);
-    r->data = malloc(size);
-    assert(r->data);
-    r->bytes_used = 0;
-    r->buffer_size = size;
-    r->next = NULL;
-    return r;
+static volatile long curl_once = CONFLATE_ONCE_INIT;
+
+/* DNS cache and TLS sessions shared by every handle's transfers. */
+static CURLSH *curl_share = NULL;
+static cb_mutex_t curl_share_locks[CURL_LOCK_DATA_LAST];
+
+static void lock_share(CURL *handle, curl_lock_data data,
+                       curl_lock_access access, void *userptr) {
+    (void) handle;
+    (void) access;
+    (void) userptr;
+    cb_mutex_enter(&curl_share_locks[data]);
 }
 
-static void free_response(struct response_buffer *response) {
-    if (!response) {
-        return;
-    }
-    if (response->next) {
-        free_response(response->next);
-    }
-    if (response->data) {
-        free(response->data);
-    }
-    free(response);
+static void unlock_share(CURL *handle, curl_lock_data data, void *userptr) {
+    (void) handle;
+    (void) userptr;
+    cb_mutex_exit(&curl_share_locks[data]);
 }
 
-static struct response_buffer *write_data_to_buffer(struct response_buffer *buffer,
-                                                    const char *data, size_t len) {
-    size_t bytes_written = 0;
-    while (bytes_written < len) {
-        size_t bytes_to_write = (len - bytes_written);
-        size_t space = buffer->buffer_size - buffer->bytes_used;
-        if (space == 0) {
-            struct response_buffer *new_buffer = mk_response_buffer(buffer->buffer_size);
-            buffer->next = new_buffer;
-            buffer = new_buffer;
-        } else {
-            char *d;
-            if (bytes_to_write > space) {
-                bytes_to_write = space;
-            }
-            d = buffer->data;
-            d = &d[buffer->bytes_used];
-            memcpy(d,&data[bytes_written], bytes_to_write);
-            bytes_written += bytes_to_write;
-            buffer->bytes_used += bytes_to_write;
+static void write_data_to_buffer(struct rest_stream *stream,
+                                 const char *data, size_t len) {
+    /* Keep room for the terminating '\0' added when a config is done */
+    size_t needed = stream->bytes_used + len + 1;
+
+    if (needed > stream->buffer_size) {
+        size_t size = stream->buffer_size;
+        while (size < needed) {
+            size <<= 1;
         }
+        stream->data = realloc(stream->data, size);
+        assert(stream->data);
+        stream->buffer_size = size;
     }
-    return buffer;
+
+    memcpy(stream->data + stream->bytes_used, data, len);
+    stream->bytes_used += len;
 }
 
-static char *assemble_complete_response(struct response_buffer *response_head) {
-    struct response_buffer *cur_buffer = response_head;
-    size_t response_size = 0;
-    char *response = NULL;
-    char *ptr;
+void init_config_scanner(struct config_scanner *scanner) {
+    const char *pattern = END_OF_CONFIG;
+    size_t i, k = 0;
 
-    if (response_head == NULL) {
-        return NULL;
+    assert(scanner);
+    memset(scanner, 0, sizeof(*scanner));
+    scanner->pattern_size = strlen(pattern);
+    assert(scanner->pattern_size > 0);
+
+    /* KMP failure table: fallback[i] is the length of the longest proper
+       prefix of the pattern that is also a suffix of pattern[0..i] */
+    for (i = 1; i < scanner->pattern_size; i++) {
+        while (k > 0 && pattern[i] != pattern[k]) {
+            k = scanner->fallback[k - 1];
+        }
+        if (pattern[i] == pattern[k]) {
+            k++;
+        }
+        scanner->fallback[i] = k;
     }
+}
+
+bool scan_for_end_of_config(struct config_scanner *scanner,
+                            const char *data, size_t size, size_t *consumed) {
+    const char *pattern = END_OF_CONFIG;
+    size_t matched = scanner->matched;
+    size_t i;
 
-    /* figure out how big the message is */
-    while (cur_buffer) {
-        response_size += cur_buffer->bytes_used;
-        cur_buffer = cur_buffer->next;
+    assert(consumed);
+
+    for (i = 0; i < size; i++) {
+        while (matched > 0 && data[i] != pattern[matched]) {
+            matched = scanner->fallback[matched - 1];
+        }
+        if (data[i] == pattern[matched]) {
+            matched++;
+        }
+        if (matched == scanner->pattern_size) {
+            scanner->matched = 0;
+            *consumed = i + 1;
+            return true;
+        }
     }
 
-    /* create buffer */
-    response = malloc(response_size + 1);
-    assert(response);
+    /* Remember the partial delimiter so it can complete in the next chunk */
+    scanner->matched = matched;
+    *consumed = size;
+    return false;
+}
+
+void init_stream(struct rest_stream *stream, conflate_handle_t *handle) {
+    stream->handle = handle;
+    stream->data = malloc(RESPONSE_BUFFER_SIZE);
+    assert(stream->data);
+    stream->buffer_size = RESPONSE_BUFFER_SIZE;
+    stream->inflater = NULL;
+    stream->headers = NULL;
+    stream->etag = NULL;
+    stream->last_modified = NULL;
+    reset_stream(stream);
+}
 
-    /* populate buffer */
-    cur_buffer = response_head;
-    ptr = response;
-    while (cur_buffer) {
-        memcpy(ptr, cur_buffer->data, cur_buffer->bytes_used);
-        ptr += cur_buffer->bytes_used;
-        cur_buffer = cur_buffer->next;
+static void end_inflate(struct rest_stream *stream) {
+#ifdef HAVE_ZLIB
+    if (stream->inflater) {
+        inflateEnd(stream->inflater);
+        free(stream->inflater);
+        stream->inflater = NULL;
     }
+#else
+    (void) stream;
+#endif
+}
 
-    response[response_size] = '\0';
+static void clear_validators(struct rest_stream *stream) {
+    free(stream->etag);
+    stream->etag = NULL;
+    free(stream->last_modified);
+    stream->last_modified = NULL;
+}
 
-    return response;
+void reset_stream(struct rest_stream *stream) {
+    stream->bytes_used = 0;
+    stream->last_data_at = gethrtime();
+    init_config_scanner(&stream->scanner);
+    end_inflate(stream);
+    clear_validators(stream);
 }
 
-static bool pattern_ends_with(const char *pattern, const char *target, size_t target_size) {
-    size_t pattern_size;
-    assert(target);
-    assert(pattern);
+void destroy_stream(struct rest_stream *stream) {
+    end_inflate(stream);
+    clear_validators(stream);
+    curl_slist_free_all(stream->headers);
+    stream->headers = NULL;
+    free(stream->data);
+    stream->data = NULL;
+    stream->bytes_used = 0;
+    stream->buffer_size = 0;
+}
 
-    pattern_size = strlen(pattern);
-    if (target_size < pattern_size) {
-        return false;
-    }
-    return memcmp(&target[target_size - pattern_size], pattern, pattern_size) == 0;
+conflate_result process_new_config(struct rest_stream *stream) {
+    conflate_result r;
+
+    stream->handle->tot_process_new_configs++;
+
+    /* The config is used straight out of the receive buffer, which is
+       kept for the next config once the callback is done with it. */
+    stream->data[stream->bytes_used] = '\0';
+    r = deliver_config(stream->handle, stream->data, stream->bytes_used,
+                       stream->url);
+
+    stream->bytes_used = 0;
+    stream->last_result = r;
+
+    return r;
+}
+
+conflate_result finish_rest_transfer(CURL *curl, struct rest_stream *stream,
+                                     struct rest_url *url) {
+    long code = 0;
+
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+    return finish_rest_response(stream, url, code);
 }
 
-static conflate_result process_new_config(conflate_handle_t *conf_handle) {
-    char *values[2];
-    kvpair_t *kv;
-    conflate_result (*call_back)(void *, kvpair_t *);
+conflate_result finish_rest_response(struct rest_stream *stream,
+                                     struct rest_url *url, long code) {
+    conflate_handle_t *handle = stream->handle;
     conflate_result r;
 
-    g_tot_process_new_configs++;
+    if (handle->conf->poll_interval_ms && code == 304) {
+        /* Nothing changed since the config we already have */
+        cb_mutex_enter(&handle->stats_lock);
+        handle->stats.configs_not_modified++;
+        cb_mutex_exit(&handle->stats_lock);
+        return CONFLATE_SUCCESS;
+    }
+
+    r = process_new_config(stream);
+
+    /* Only remember validators for a config the application took,
+       otherwise we'd keep getting 304s for one it rejected. */
+    if (handle->conf->poll_interval_ms && code == 200 &&
+        r == CONFLATE_SUCCESS) {
+        free(url->etag);
+        url->etag = stream->etag;
+        stream->etag = NULL;
+        free(url->last_modified);
+        url->last_modified = stream->last_modified;
+        stream->last_modified = NULL;
+    }
+
+    return r;
+}
+
+static void scan_data(struct rest_stream *stream, const char *ptr,
+                      size_t remaining) {
+    /* A chunk may hold the tail of one config, several complete
+       configs, or only part of a delimiter, so keep cutting configs
+       out of it until nothing is left. */
+    while (remaining > 0) {
+        size_t consumed;
+        bool end_of_message = scan_for_end_of_config(&stream->scanner, ptr,
+                                                     remaining, &consumed);
+        write_data_to_buffer(stream, ptr, consumed);
+        if (end_of_message) {
+            process_new_config(stream);
+        }
+        ptr += consumed;
+        remaining -= consumed;
+    }
+}
+
+#ifdef HAVE_ZLIB
+/* Feed a chunk to the inflater, scanning the output for configs as it
+   is produced.  Returns the zlib error, or Z_OK. */
+static int run_inflate(struct rest_stream *stream, const char *data,
+                       size_t size, size_t *decoded) {
+    z_stream *z = stream->inflater;
+    char out[16384];
+
+    z->next_in = (Bytef *) data;
+    z->avail_in = (uInt) size;
+
+    do {
+        size_t produced;
+        int rc;
+
+        z->next_out = (Bytef *) out;
+        z->avail_out = sizeof(out);
+        rc = inflate(z, Z_NO_FLUSH);
+
+        if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+            return rc;
+        }
+
+        produced = sizeof(out) - z->avail_out;
+        *decoded += produced;
+        scan_data(stream, out, produced);
 
-    /* construct the new config from its components */
-    values[0] = assemble_complete_response(response_buffer_head);
-    values[1] = NULL;
+        if (rc == Z_STREAM_END) {
+            /* Concatenated gzip members keep a long stream going */
+            if (z->avail_in == 0 || inflateReset(z) != Z_OK) {
+                break;
+            }
+        } else if (rc == Z_BUF_ERROR) {
+            break;
+        }
+    } while (z->avail_in > 0 || z->avail_out == 0);
 
-    free_response(response_buffer_head);
-    response_buffer_head = NULL;
-    cur_response_buffer = NULL;
+    return Z_OK;
+}
 
-    if (values[0] == NULL) {
-        fprintf(stderr, "ERROR: invalid response from REST server\n");
-        return CONFLATE_ERROR;
+/* Inflate a chunk of a compressed body.  Returns false on corrupt
+   input. */
+static bool inflate_data(struct rest_stream *stream, const char *data,
+                         size_t size, size_t *decoded) {
+    size_t held = stream->inflate_head_len;
+    int rc;
+
+    *decoded = 0;
+    rc = run_inflate(stream, data, size, decoded);
+
+    if (held < sizeof(stream->inflate_head)) {
+        if (rc == Z_DATA_ERROR && *decoded == 0) {
+            /* zlib rejects a bad gzip or zlib header by its second
+               byte; some servers send "deflate" without the wrapper, so
+               start over reading raw deflate. */
+            stream->inflate_head_len = sizeof(stream->inflate_head);
+            inflateEnd(stream->inflater);
+            if (inflateInit2(stream->inflater, -MAX_WBITS) != Z_OK) {
+                return false;
+            }
+            rc = run_inflate(stream, (const char *) stream->inflate_head,
+                             held, decoded);
+            if (rc == Z_OK) {
+                rc = run_inflate(stream, data, size, decoded);
+            }
+        } else {
+            while (stream->inflate_head_len < sizeof(stream->inflate_head) &&
+                   stream->inflate_head_len - held < size) {
+                stream->inflate_head[stream->inflate_head_len] =
+                    (unsigned char) data[stream->inflate_head_len - held];
+                stream->inflate_head_len++;
+            }
+        }
     }
 
-    kv = mk_kvpair(CONFIG_KEY, values);
+    return rc == Z_OK;
+}
+#endif
 
-    if (conf_handle->url != NULL) {
-        char *url[2];
-        url[0] = conf_handle->url;
-        url[1] = NULL;
-        kv->next = mk_kvpair("url", url);
+bool start_inflate(struct rest_stream *stream) {
+#ifdef HAVE_ZLIB
+    end_inflate(stream);
+    stream->inflater = calloc(1, sizeof(z_stream));
+    assert(stream->inflater);
+    stream->inflate_head_len = 0;
+    /* Accept both gzip and zlib framing */
+    if (inflateInit2(stream->inflater, MAX_WBITS + 32) != Z_OK) {
+        free(stream->inflater);
+        stream->inflater = NULL;
+        return false;
     }
+    return true;
+#else
+    (void) stream;
+    return false;
+#endif
+}
 
-    /* execute the provided call back */
-    call_back = conf_handle->conf->new_config;
-    r = call_back(conf_handle->conf->userdata, kv);
+size_t handle_response(void *data, size_t s, size_t num, void *cb) {
+    struct rest_stream *stream = (struct rest_stream *) cb;
+    conflate_handle_t *handle = stream->handle;
+    size_t size = s * num;
+    size_t decoded = size;
 
-    /* clean up */
-    free_kvpair(kv);
-    free(values[0]);
+    stream->last_data_at = gethrtime();
 
-    response_buffer_head = mk_response_buffer(RESPONSE_BUFFER_SIZE);
-    cur_response_buffer = response_buffer_head;
+#ifdef HAVE_ZLIB
+    if (stream->inflater) {
+        if (!inflate_data(stream, data, size, &decoded)) {
+            handle->conf->log(handle->conf->userdata, LOG_LVL_WARN,
+                              "Corrupt compressed config from %s", stream->url);
+            return 0;
+        }
+    } else
+#endif
+    {
+        scan_data(stream, data, size);
+    }
 
-    return r;
+    cb_mutex_enter(&handle->stats_lock);
+    handle->stats.bytes_received += size;
+    handle->stats.bytes_decoded += decoded;
+    cb_mutex_exit(&handle->stats_lock);
+
+    return size;
+}
+
+/* Copy a header's value, without surrounding whitespace. */
+static char *header_value(const char *data, size_t size, size_t name_len) {
+    const char *value = data + name_len;
+    size_t len = size - name_len;
+    char *rv;
+
+    while (len > 0 && (*value == ' ' || *value == '\t')) {
+        value++;
+        len--;
+    }
+    while (len > 0 && (value[len - 1] == '\r' || value[len - 1] == '\n' ||
+                       value[len - 1] == ' ' || value[len - 1] == '\t')) {
+        len--;
+    }
+
+    rv = malloc(len + 1);
+    assert(rv);
+    memcpy(rv, value, len);
+    rv[len] = '\0';
+    return rv;
+}
+
+static bool is_header(const char *data, size_t size, const char *name) {
+    size_t len = strlen(name);
+    return size > len && strncasecmp(data, name, len) == 0;
 }
 
-static size_t handle_response(void *data, size_t s, size_t num, void *cb) {
-    conflate_handle_t *c_handle = (conflate_handle_t *) cb;
+static size_t handle_header(char *data, size_t s, size_t num, void *cb) {
+    struct rest_stream *stream = (struct rest_stream *) cb;
     size_t size = s * num;
-    bool end_of_message = pattern_ends_with(END_OF_CONFIG, data, size);
-    cur_response_buffer = write_data_to_buffer(cur_response_buffer, data, size);
-    if (end_of_message) {
-        process_new_config(c_handle);
+
+    stream->last_data_at = gethrtime();
+
+    if (size > 5 && memcmp(data, "HTTP/", 5) == 0) {
+        /* Status line of a new response (e.g. after a redirect) */
+        end_inflate(stream);
+        clear_validators(stream);
+    } else if (is_header(data, size, "ETag:")) {
+        free(stream->etag);
+        stream->etag = header_value(data, size, strlen("ETag:"));
+    } else if (is_header(data, size, "Last-Modified:")) {
+        free(stream->last_modified);
+        stream->last_modified = header_value(data, size, strlen("Last-Modified:"));
+    } else if (is_header(data, size, "Content-Encoding:")) {
+#ifdef HAVE_ZLIB
+        char *value = header_value(data, size, strlen("Content-Encoding:"));
+
+        if (strncasecmp(value, "gzip", 4) == 0 ||
+            strncasecmp(value, "x-gzip", 6) == 0 ||
+            strncasecmp(value, "deflate", 7) == 0) {
+            if (!start_inflate(stream)) {
+                free(value);
+                return 0;
+            }
+        }
+        free(value);
+#endif
     }
+
     return size;
 }
 
+/* curl's own low speed check averages over several seconds, so a
+   stream that just delivered a big config would take much longer than
+   stream_idle_timeout_s to be dropped.  Check the silence directly. */
+static int check_stream_idle(void *clientp,
+                             curl_off_t dltotal, curl_off_t dlnow,
+                             curl_off_t ultotal, curl_off_t ulnow) {
+    struct rest_stream *stream = (struct rest_stream *) clientp;
+    hrtime_t timeout = (hrtime_t) stream->handle->conf->stream_idle_timeout_s
+        * 1000000000;
+    (void) dltotal;
+    (void) dlnow;
+    (void) ultotal;
+    (void) ulnow;
+
+    if (timeout != 0 && gethrtime() - stream->last_data_at > timeout) {
+        return 1;
+    }
+    return 0;
+}
+
+static void set_tcp_option(curl_socket_t fd, int level, int name,
+                           unsigned int value) {
+    int optval = (int) value;
+    socklen_t optlen = sizeof(optval);
+    if (value != 0) {
+        setsockopt(fd, level, name, (void *) &optval, optlen);
+    }
+}
+
 static int setup_curl_sock(void *clientp,
                            curl_socket_t curlfd,
                            curlsocktype purpose) {
+  conflate_config_t *conf = (conflate_config_t *) clientp;
   int       optval = 1;
   socklen_t optlen = sizeof(optval);
   setsockopt(curlfd, SOL_SOCKET, SO_KEEPALIVE, (void *) &optval, optlen);
-  (void) clientp;
+
+  /* The system keepalive defaults take hours to notice a dead peer. */
+#ifdef TCP_KEEPIDLE
+  set_tcp_option(curlfd, IPPROTO_TCP, TCP_KEEPIDLE, conf->tcp_keepalive_idle_s);
+#endif
+#ifdef TCP_KEEPINTVL
+  set_tcp_option(curlfd, IPPROTO_TCP, TCP_KEEPINTVL,
+                 conf->tcp_keepalive_interval_s);
+#endif
+#ifdef TCP_KEEPCNT
+  set_tcp_option(curlfd, IPPROTO_TCP, TCP_KEEPCNT, conf->tcp_keepalive_count);
+#endif
+#ifdef TCP_USER_TIMEOUT
+  set_tcp_option(curlfd, IPPROTO_TCP, TCP_USER_TIMEOUT,
+                 conf->tcp_user_timeout_ms);
+#endif
   (void) purpose;
   return 0;
 }
 
-static void setup_handle(CURL *handle, char *url, char *userpass,
-                         conflate_handle_t *chandle,
-                         size_t (response_handler)(void *, size_t, size_t, void *)) {
+static struct curl_slist *append_header(struct curl_slist *headers,
+                                        const char *name, const char *value) {
+    size_t buff_size = strlen(name) + strlen(value) + 3;
+    char *header = malloc(buff_size);
+    assert(header);
+    snprintf(header, buff_size, "%s: %s", name, value);
+    headers = curl_slist_append(headers, header);
+    free(header);
+    return headers;
+}
+
+void setup_handle(CURL *handle, struct rest_url *url, char *userpass,
+                  struct rest_stream *stream,
+                  size_t (response_handler)(void *, size_t, size_t, void *)) {
     if (url != NULL) {
 
         CURLcode c;
 
         c = curl_easy_setopt(handle, CURLOPT_SOCKOPTFUNCTION, setup_curl_sock);
         assert(c == CURLE_OK);
-        c = curl_easy_setopt(handle, CURLOPT_WRITEDATA, chandle);
+        c = curl_easy_setopt(handle, CURLOPT_SOCKOPTDATA, stream->handle->conf);
+        assert(c == CURLE_OK);
+        /* Give up on a stream that stays silent for too long, so we
+           move on to the next URL rather than wait for TCP to notice.
+           The low speed limit also makes curl wake up idle transfers
+           every second to run check_stream_idle(). */
+        c = curl_easy_setopt(handle, CURLOPT_LOW_SPEED_LIMIT,
+                             stream->handle->conf->stream_idle_timeout_s ? 1L : 0L);
+        assert(c == CURLE_OK);
+        c = curl_easy_setopt(handle, CURLOPT_LOW_SPEED_TIME,
+                             (long) stream->handle->conf->stream_idle_timeout_s);
+        assert(c == CURLE_OK);
+        c = curl_easy_setopt(handle, CURLOPT_XFERINFOFUNCTION, check_stream_idle);
+        assert(c == CURLE_OK);
+        c = curl_easy_setopt(handle, CURLOPT_XFERINFODATA, stream);
+        assert(c == CURLE_OK);
+        c = curl_easy_setopt(handle, CURLOPT_NOPROGRESS,
+                             stream->handle->conf->stream_idle_timeout_s ? 0L : 1L);
+        assert(c == CURLE_OK);
+        c = curl_easy_setopt(handle, CURLOPT_WRITEDATA, stream);
         assert(c == CURLE_OK);
         c = curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, response_handler);
         assert(c == CURLE_OK);
-        c = curl_easy_setopt(handle, CURLOPT_URL, url);
+        /* Talk HTTP over a local socket for http+unix:// URLs. */
+        c = curl_easy_setopt(handle, CURLOPT_URL,
+                             url->unix_url ? url->unix_url : url->url);
+        assert(c == CURLE_OK);
+        c = curl_easy_setopt(handle, CURLOPT_UNIX_SOCKET_PATH, url->unix_socket);
+        assert(c == CURLE_OK);
+
+        /* Resolve through the cache shared by all handles, so a
+           reconnect doesn't depend on DNS answering right then. */
+        c = curl_easy_setopt(handle, CURLOPT_SHARE, curl_share);
+        assert(c == CURLE_OK);
+        if (stream->handle->conf->dns_cache_timeout_s) {
+            c = curl_easy_setopt(handle, CURLOPT_DNS_CACHE_TIMEOUT,
+                                 (long) stream->handle->conf->dns_cache_timeout_s);
+            assert(c == CURLE_OK);
+        }
+        c = curl_easy_setopt(handle, CURLOPT_RESOLVE, stream->handle->resolve);
         assert(c == CURLE_OK);
 
         if (userpass != NULL) {
@@ -221,6 +557,68 @@ static void setup_handle(CURL *handle, char *url, char *userpass,
 
         c = curl_easy_setopt(handle, CURLOPT_HTTPGET, 1);
         assert(c == CURLE_OK);
+
+        c = curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, handle_header);
+        assert(c == CURLE_OK);
+        c = curl_easy_setopt(handle, CURLOPT_HEADERDATA, stream);
+        assert(c == CURLE_OK);
+
+        /* We inflate bodies ourselves so configs can be cut out of the
+           decoded bytes as they arrive. */
+        c = curl_easy_setopt(handle, CURLOPT_HTTP_CONTENT_DECODING, 0L);
+        assert(c == CURLE_OK);
+
+        curl_slist_free_all(stream->headers);
+        stream->headers = NULL;
+#ifdef HAVE_ZLIB
+        if (stream->handle->conf->accept_compressed) {
+            stream->headers = curl_slist_append(stream->headers,
+                                                "Accept-Encoding: gzip, deflate");
+        }
+#endif
+        if (stream->handle->conf->poll_interval_ms) {
+            /* Let the server answer 304 if we already have its config */
+            if (url->etag) {
+                stream->headers = append_header(stream->headers,
+                                                "If-None-Match", url->etag);
+            }
+            if (url->last_modified) {
+                stream->headers = append_header(stream->headers,
+                                                "If-Modified-Since",
+                                                url->last_modified);
+            }
+        }
+        c = curl_easy_setopt(handle, CURLOPT_HTTPHEADER, stream->headers);
+        assert(c == CURLE_OK);
+    }
+}
+
+char *mk_userpass(conflate_handle_t *handle) {
+    char *userpass = NULL;
+
+    if (handle->conf->jid && strlen(handle->conf->jid)) {
+        size_t buff_size = strlen(handle->conf->jid) + strlen(handle->conf->pass) + 2;
+        userpass = (char *) malloc(buff_size);
+        assert(userpass);
+        snprintf(userpass, buff_size, "%s:%s", handle->conf->jid, handle->conf->pass);
+        userpass[buff_size - 1] = '\0';
+    }
+
+    return userpass;
+}
+
+void process_saved_config(conflate_handle_t *handle) {
+    kvpair_t *conf = load_kvpairs_mapped(handle, handle->conf->save_path);
+    if (conf) {
+        conflate_result r;
+
+        cb_mutex_enter(&handle->callback_lock);
+        r = handle->conf->new_config(handle->conf->userdata, conf);
+        if (r == CONFLATE_SUCCESS && handle->conf->keep_current_config) {
+            publish_config(handle, conf);
+        }
+        cb_mutex_exit(&handle->callback_lock);
+        free_kvpair(conf);
     }
 }
 
@@ -241,30 +639,243 @@ static char *strsep(char **stringp, char *pattern) {
 }
 #endif
 
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+bool parse_unix_socket_url(const char *url, char **socket_path,
+                           char **http_url) {
+    const char *authority;
+    const char *path;
+    char *out;
+    size_t len;
+
+    if (strncasecmp(url, UNIX_SOCKET_URL_PREFIX,
+                    strlen(UNIX_SOCKET_URL_PREFIX)) != 0) {
+        return false;
+    }
+
+    authority = url + strlen(UNIX_SOCKET_URL_PREFIX);
+    path = strchr(authority, '/');
+    if (path == NULL) {
+        path = authority + strlen(authority);
+    }
+    if (path == authority) {
+        return false;
+    }
+
+    /* The socket path is percent encoded to fit in the authority. */
+    out = *socket_path = malloc(path - authority + 1);
+    assert(out);
+    while (authority < path) {
+        if (*authority == '%' && path - authority >= 3 &&
+            hex_value(authority[1]) >= 0 && hex_value(authority[2]) >= 0) {
+            *out++ = (char) (hex_value(authority[1]) << 4 |
+                             hex_value(authority[2]));
+            authority += 3;
+        } else {
+            *out++ = *authority++;
+        }
+    }
+    *out = '\0';
+
+    len = strlen("http://localhost") + strlen(path) + 2;
+    *http_url = malloc(len);
+    assert(*http_url);
+    snprintf(*http_url, len, "http://localhost%s", *path ? path : "/");
+
+    return true;
+}
+
+void init_rest_urls(conflate_handle_t *handle) {
+    char *next;
+    char *p;
+    int n = 1;
+
+    /* The host list doesn't change, so split it once up front. */
+    handle->hosts = safe_strdup(handle->conf->host);
+    for (p = handle->hosts; *p; p++) {
+        if (*p == '|') {
+            n++;
+        }
+    }
+
+    handle->urls = calloc(n, sizeof(struct rest_url));
+    assert(handle->urls);
+    handle->nurls = 0;
+    next = handle->hosts;
+    while (next != NULL) {
+        struct rest_url *url = &handle->urls[handle->nurls++];
+        url->url = strsep(&next, "|");
+        parse_unix_socket_url(url->url, &url->unix_socket, &url->unix_url);
+    }
+
+    handle->userpass = mk_userpass(handle);
+
+    if (handle->conf->resolve != NULL) {
+        char *entries = safe_strdup(handle->conf->resolve);
+        next = entries;
+        while (next != NULL) {
+            p = strsep(&next, ",");
+            if (*p) {
+                handle->resolve = curl_slist_append(handle->resolve, p);
+            }
+        }
+        free(entries);
+    }
+
+    handle->retry_seed = (unsigned int) gethrtime() ^ (unsigned int) (size_t) handle;
+}
+
+/* Retrying without any delay would just spin on a dead server. */
+#define MIN_RETRY_DELAY ((hrtime_t) 1000000)
+
+static hrtime_t backoff_delay(conflate_handle_t *handle, int failures) {
+    conflate_config_t *conf = handle->conf;
+    hrtime_t delay = (hrtime_t) conf->retry_initial_ms * 1000000;
+    hrtime_t max_delay = (hrtime_t) conf->retry_max_ms * 1000000;
+    unsigned int jitter = conf->retry_jitter_pct > 100 ? 100 : conf->retry_jitter_pct;
+
+    if (delay < MIN_RETRY_DELAY) {
+        delay = MIN_RETRY_DELAY;
+    }
+
+    while (failures-- > 1 && delay < max_delay) {
+        delay <<= 1;
+    }
+    if (delay > max_delay) {
+        delay = max_delay;
+    }
+
+    if (jitter > 0 && delay > 0) {
+        /* xorshift is plenty to keep clients from retrying in lockstep */
+        unsigned int x = handle->retry_seed;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        handle->retry_seed = x;
+        delay -= (delay / 100) * jitter / 1000 * (x % 1001);
+    }
+
+    return delay < MIN_RETRY_DELAY ? MIN_RETRY_DELAY : delay;
+}
+
+bool rest_url_ready(struct rest_url *url, hrtime_t now) {
+    return url->retry_after <= now;
+}
+
+void rest_url_succeeded(struct rest_url *url) {
+    url->failures = 0;
+    url->retry_after = 0;
+}
+
+void rest_url_failed(conflate_handle_t *handle, struct rest_url *url) {
+    url->failures++;
+    url->retry_after = gethrtime() + backoff_delay(handle, url->failures);
+}
+
+hrtime_t rest_retry_delay(conflate_handle_t *handle, bool succeeded) {
+    hrtime_t now = gethrtime();
+    hrtime_t earliest = 0;
+    hrtime_t delay;
+    int i;
+
+    if (succeeded) {
+        handle->failed_rounds = 0;
+        if (handle->conf->poll_interval_ms) {
+            return (hrtime_t) handle->conf->poll_interval_ms * 1000000;
+        }
+        return backoff_delay(handle, 1);
+    }
+
+    delay = backoff_delay(handle, ++handle->failed_rounds);
+
+    /* No point in waking up before at least one URL may be tried. */
+    for (i = 0; i < handle->nurls; i++) {
+        if (i == 0 || handle->urls[i].retry_after < earliest) {
+            earliest = handle->urls[i].retry_after;
+        }
+    }
+    if (earliest > now + delay) {
+        delay = earliest - now;
+    }
+
+    return delay;
+}
+
+hrtime_t rest_round_delay(conflate_handle_t *handle, bool succeeded,
+                          int start_configs) {
+    return rest_retry_delay(handle, succeeded ||
+                            handle->tot_process_new_configs != start_configs);
+}
+
+static void sleep_ns(hrtime_t ns) {
+#ifdef WIN32
+    Sleep((DWORD) (ns / 1000000));
+#else
+    struct timespec ts;
+    ts.tv_sec = (time_t) (ns / 1000000000);
+    ts.tv_nsec = (long) (ns % 1000000000);
+    while (nanosleep(&ts, &ts) != 0) {
+        /* interrupted, sleep for the remainder */
+    }
+#endif
+}
+
+static void init_curl(void) {
+    CURLcode c = curl_global_init(curl_init_flags);
+    CURLSHcode sc;
+    int i;
+    assert(c == CURLE_OK);
+
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        cb_mutex_initialize(&curl_share_locks[i]);
+    }
+    curl_share = curl_share_init();
+    assert(curl_share);
+    sc = curl_share_setopt(curl_share, CURLSHOPT_LOCKFUNC, lock_share);
+    assert(sc == CURLSHE_OK);
+    sc = curl_share_setopt(curl_share, CURLSHOPT_UNLOCKFUNC, unlock_share);
+    assert(sc == CURLSHE_OK);
+    sc = curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    assert(sc == CURLSHE_OK);
+    sc = curl_share_setopt(curl_share, CURLSHOPT_SHARE,
+                           CURL_LOCK_DATA_SSL_SESSION);
+    assert(sc == CURLSHE_OK);
+}
+
+void init_rest_conflate(void) {
+    /* curl_global_init() isn't thread safe, so it's done once, whichever
+       thread calling start_conflate() gets here first, rather than from
+       every handle's own thread. */
+    conflate_once(&curl_once, init_curl);
+}
+
 void run_rest_conflate(void *arg) {
     conflate_handle_t *handle = (conflate_handle_t *) arg;
     char curl_error_string[CURL_ERROR_SIZE];
-    kvpair_t *conf;
-    CURLcode c;
     CURL *curl_handle;
     bool always_retry = true;
 
-
+    /* Racing several URLs needs concurrent transfers, so such handles
+       are driven through a curl_multi loop private to this thread. */
+    if (handle->conf->race_urls > 1 && rest_loop_run_handle(handle)) {
+        return;
+    }
 
     /* prep the buffers used to hold the config */
-    response_buffer_head = mk_response_buffer(RESPONSE_BUFFER_SIZE);
-    cur_response_buffer = response_buffer_head;
+    init_stream(&handle->stream, handle);
+    init_rest_urls(handle);
 
     /* Before connecting and all that, load the stored config */
-    conf = load_kvpairs(handle, handle->conf->save_path);
-    if (conf) {
-        handle->conf->new_config(handle->conf->userdata, conf);
-        free_kvpair(conf);
-    }
-
-    /* init curl */
-    c = curl_global_init(curl_init_flags);
-    assert(c == CURLE_OK);
+    process_saved_config(handle);
 
     curl_handle = curl_easy_init();
     assert(curl_handle);
@@ -272,38 +883,42 @@ void run_rest_conflate(void *arg) {
     curl_easy_setopt(curl_handle, CURLOPT_ERRORBUFFER, &curl_error_string);
 
     while (true) {
-        int start_tot_process_new_configs = g_tot_process_new_configs;
+        int start_tot_process_new_configs = handle->tot_process_new_configs;
         bool succeeding = true;
 
         while (succeeding) {
-            char *urls = strdup(handle->conf->host);  /* Might be a '|' delimited list of url's. */
-            char *next = urls;
-            char *userpass = NULL;
+            hrtime_t now = gethrtime();
+            int round_start_configs = handle->tot_process_new_configs;
+            int i;
+
             succeeding = false;
 
-            if (handle->conf->jid && strlen(handle->conf->jid)) {
-                size_t buff_size = strlen(handle->conf->jid) + strlen(handle->conf->pass) + 2;
-                userpass = (char *) malloc(buff_size);
-                assert(userpass);
-                snprintf(userpass, buff_size, "%s:%s", handle->conf->jid, handle->conf->pass);
-                userpass[buff_size - 1] = '\0';
-            }
+            for (i = 0; i < handle->nurls && !succeeding; i++) {
+                struct rest_url *url = &handle->urls[i];
+                int start_configs = handle->tot_process_new_configs;
 
-            while (next != NULL) {
-                char *url = strsep(&next, "|");
+                /* Skip URLs that failed recently until their backoff expires */
+                if (!rest_url_ready(url, now)) {
+                    continue;
+                }
 
-                handle->url = url;
+                handle->url = url->url;
+                handle->stream.url = url->url;
+                /* Drop whatever a broken connection left behind. */
+                reset_stream(&handle->stream);
 
                 setup_handle(curl_handle,
-                             url,  /* The full URL. */
-                             userpass, /* The auth user and password. */
-                             handle, handle_response);
+                             url,  /* The URL and its validators. */
+                             handle->userpass, /* The auth user and password. */
+                             &handle->stream, handle_response);
 
                 if (curl_easy_perform(curl_handle) == 0) {
                     /* We reach here if the REST server didn't provide a
                        streaming JSON response and so we need to process
                        the just-one-JSON response */
-                    conflate_result r = process_new_config(handle);
+                    conflate_result r = finish_rest_transfer(curl_handle,
+                                                             &handle->stream,
+                                                             url);
                     if (r == CONFLATE_SUCCESS ||
                         r == CONFLATE_ERROR) {
                       /* Restart at the beginning of the urls list */
@@ -312,21 +927,29 @@ void run_rest_conflate(void *arg) {
                       /* value of CONFLATE_ERROR_BAD_SOURCE, then */
                       /* we should try the next url on the list. */
                       succeeding = true;
-                      next = NULL;
+                      rest_url_succeeded(url);
+                    } else {
+                      rest_url_failed(handle, url);
                     }
                 } else {
                     fprintf(stderr, "WARNING: curl error: %s from: %s\n",
-                            curl_error_string, url);
+                            curl_error_string, url->url);
+                    /* A stream that delivered configs before it broke
+                       was healthy, so don't hold the failure against it. */
+                    if (handle->tot_process_new_configs != start_configs) {
+                        rest_url_succeeded(url);
+                    } else {
+                        rest_url_failed(handle, url);
+                    }
                 }
             }
 
-            sleep(1);  /* Don't overload the REST servers with tons of retries. */
-
-            free(urls);
-            free(userpass);
+            /* Don't overload the REST servers with tons of retries. */
+            sleep_ns(rest_round_delay(handle, succeeding,
+                                      round_start_configs));
         }
 
-        if (start_tot_process_new_configs == g_tot_process_new_configs) {
+        if (start_tot_process_new_configs == handle->tot_process_new_configs) {
             fprintf(stderr, "ERROR: could not contact REST server(s): %s\n", handle->conf->host);
 
             if (always_retry == false) {
@@ -338,9 +961,7 @@ void run_rest_conflate(void *arg) {
         }
     }
 
-    free_response(response_buffer_head);
-    response_buffer_head = NULL;
-    cur_response_buffer = NULL;
+    destroy_stream(&handle->stream);
 
     curl_easy_cleanup(curl_handle);
 
@@ -1,11 +1,130 @@
 #ifndef REST_H
 #define	REST_H
 
+#include <platform/platform.h>
+#include <curl/curl.h>
+
 #define RESPONSE_BUFFER_SIZE 4096
 #define END_OF_CONFIG "\n\n\n\n"
 #define CONFIG_KEY "contents"
 
+/* Streaming END_OF_CONFIG detector that remembers partial delimiters
+   between curl write callbacks. */
+struct config_scanner {
+    size_t pattern_size;
+    size_t matched;
+    size_t fallback[sizeof(END_OF_CONFIG)];
+};
+
+void init_config_scanner(struct config_scanner *scanner);
+
+/* Scan data for the end of a config.  Returns true if a delimiter was
+   completed, with *consumed set to the number of bytes up to and
+   including it; otherwise all of data is consumed. */
+bool scan_for_end_of_config(struct config_scanner *scanner,
+                            const char *data, size_t size, size_t *consumed);
+
+/* Everything needed to assemble configs out of one REST connection.
+   Each handle owns its streams, so handles don't share any state. */
+struct rest_stream {
+    conflate_handle_t *handle;
+    char *url;
+    char *data;          /* Grows geometrically, reused across configs. */
+    size_t bytes_used;
+    size_t buffer_size;
+    struct config_scanner scanner;
+    conflate_result last_result; /* What new_config said last time. */
+    struct z_stream_s *inflater;  /* Set while the body is compressed. */
+    unsigned char inflate_head[2]; /* Start of the compressed body, */
+    size_t inflate_head_len;       /* until its framing is settled. */
+    struct curl_slist *headers;   /* Extra request headers. */
+    char *etag;                   /* Validators of the current response. */
+    char *last_modified;
+    hrtime_t last_data_at;        /* When anything was last received. */
+};
+
+/* One entry of the '|' separated host list and its health. */
+struct rest_url {
+    char *url;
+    int failures;          /* Consecutive failed attempts. */
+    hrtime_t retry_after;  /* Skip this URL until then. */
+    char *etag;            /* Validators of the last config polled. */
+    char *last_modified;
+    char *unix_socket;     /* Socket path of an http+unix:// URL, */
+    char *unix_url;        /* and the HTTP URL to request over it. */
+};
+
+/* REST URLs reaching a server on a Unix domain socket look like
+   http+unix://%2Fpath%2Fto%2Fsocket/path/on/server */
+#define UNIX_SOCKET_URL_PREFIX "http+unix://"
+
+/* Split an http+unix:// URL into the (decoded) socket path and a plain
+   http:// URL for the request.  Returns false for other URLs. */
+bool parse_unix_socket_url(const char *url, char **socket_path,
+                           char **http_url);
+
+void init_stream(struct rest_stream *stream, conflate_handle_t *handle);
+/* Forget any partial config, e.g. when starting a new connection. */
+void reset_stream(struct rest_stream *stream);
+void destroy_stream(struct rest_stream *stream);
+
+/* Deliver the config assembled in the stream to new_config. */
+conflate_result process_new_config(struct rest_stream *stream);
+
+/* Deal with a transfer that ended without a curl error: a 304 to a
+   conditional poll keeps the current config, anything else goes to
+   process_new_config(). */
+conflate_result finish_rest_transfer(CURL *curl, struct rest_stream *stream,
+                                     struct rest_url *url);
+
+/* finish_rest_transfer() for a response with the given HTTP status. */
+conflate_result finish_rest_response(struct rest_stream *stream,
+                                     struct rest_url *url, long code);
+
+/* Inflate the rest of the body (gzip, zlib or raw deflate) before
+   scanning it for configs.  Returns false if zlib is unavailable. */
+bool start_inflate(struct rest_stream *stream);
+
+/* curl write callback feeding the rest_stream passed as cb. */
+size_t handle_response(void *data, size_t s, size_t num, void *cb);
+
+void setup_handle(CURL *handle, struct rest_url *url, char *userpass,
+                  struct rest_stream *stream,
+                  size_t (response_handler)(void *, size_t, size_t, void *));
+
+/* Build the "user:pass" string for basic auth, or NULL if none. */
+char *mk_userpass(conflate_handle_t *handle);
+
+/* Split the host list and prepare auth once per handle. */
+void init_rest_urls(conflate_handle_t *handle);
+
+bool rest_url_ready(struct rest_url *url, hrtime_t now);
+void rest_url_succeeded(struct rest_url *url);
+void rest_url_failed(conflate_handle_t *handle, struct rest_url *url);
+
+/* How long to wait before the next pass over the URL list, backing off
+   exponentially (with jitter) while passes keep failing. */
+hrtime_t rest_retry_delay(conflate_handle_t *handle, bool succeeded);
+
+/* rest_retry_delay() after a pass over the URL list that started with
+   tot_process_new_configs at start_configs.  A pass that got configs
+   succeeded, even if the stream they came on broke afterwards. */
+hrtime_t rest_round_delay(conflate_handle_t *handle, bool succeeded,
+                          int start_configs);
+
+/* Hand the config persisted under save_path (if any) to new_config. */
+void process_saved_config(conflate_handle_t *handle);
+
+void init_rest_conflate(void);
 void run_rest_conflate(void *arg);
 
+/* Drive the handle from the shared curl_multi I/O thread.  Returns
+   false if the shared loop isn't available on this platform. */
+bool rest_loop_add_handle(conflate_handle_t *handle);
+
+/* Drive the handle from a curl_multi loop private to the calling
+   thread.  Only returns (false) if such a loop can't be set up. */
+bool rest_loop_run_handle(conflate_handle_t *handle);
+
 #endif	/* REST_H */
 
@@ -0,0 +1,574 @@
+/*
+ * A single I/O thread driving the REST config streams of any number of
+ * conflate handles through one curl_multi handle, instead of a thread
+ * (and blocking curl_easy_perform() loop) per handle.
+ *
+ * The per handle logic mirrors run_rest_conflate(): walk the '|'
+ * separated URL list in order (skipping URLs still backing off), and
+ * restart at the beginning after rest_retry_delay() once a config was
+ * processed or the list ran out.
+ *
+ * With race_urls > 1, that many URLs are connected to at once and the
+ * first to deliver a usable config wins; the others are cancelled.
+ * Handles that race without sharing the I/O thread run the same loop
+ * privately on their own thread.
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "conflate.h"
+#include "rest.h"
+#include "conflate_internal.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#define REST_LOOP_MAX_EVENTS 64
+
+/* One transfer against one URL of a handle's host list. */
+struct rest_conn {
+    struct rest_loop_handle *lh;
+    CURL *curl;
+    struct rest_url *url;
+    struct rest_stream stream;
+    int start_configs;  /* Handle's config count when the transfer began. */
+    bool cancelled;     /* Lost the race, remove as soon as possible. */
+    char curl_error_string[CURL_ERROR_SIZE];
+    struct rest_conn *next;
+};
+
+/* Per handle state owned by the loop thread. */
+struct rest_loop_handle {
+    conflate_handle_t *handle;
+
+    struct rest_conn *conns; /* Transfers in flight. */
+    int nconns;
+    struct rest_conn *winner; /* First transfer to deliver a good config. */
+
+    int next_url;
+    hrtime_t retry_at; /* When to start the next round, 0 if not waiting. */
+    int round_start_configs;
+
+    struct rest_loop_handle *next;
+};
+
+struct rest_loop {
+    CURLM *multi;
+    int epoll_fd;
+    int wakeup_fd[2];
+
+    hrtime_t curl_timeout_at; /* 0 if curl has no timer pending. */
+
+    cb_mutex_t mutex;          /* Protects pending. */
+    conflate_handle_t **pending;
+    int npending;
+
+    struct rest_loop_handle *handles;
+
+    cb_thread_t thread;
+};
+
+static struct rest_loop *shared_loop = NULL;
+static volatile long shared_loop_once = CONFLATE_ONCE_INIT;
+
+static int loop_socket_cb(CURL *easy, curl_socket_t s, int what,
+                          void *userp, void *socketp) {
+    struct rest_loop *loop = (struct rest_loop *) userp;
+    struct epoll_event ev;
+    (void) easy;
+
+    if (what == CURL_POLL_REMOVE) {
+        /* The socket may already be closed, so ignore errors here. */
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, s, NULL);
+        curl_multi_assign(loop->multi, s, NULL);
+        return 0;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.data.fd = s;
+    if (what & CURL_POLL_IN) {
+        ev.events |= EPOLLIN;
+    }
+    if (what & CURL_POLL_OUT) {
+        ev.events |= EPOLLOUT;
+    }
+
+    if (socketp == NULL) {
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, s, &ev) == 0) {
+            curl_multi_assign(loop->multi, s, loop);
+        } else {
+            perror("epoll_ctl(ADD)");
+        }
+    } else if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, s, &ev) != 0) {
+        perror("epoll_ctl(MOD)");
+    }
+
+    return 0;
+}
+
+static int loop_timer_cb(CURLM *multi, long timeout_ms, void *userp) {
+    struct rest_loop *loop = (struct rest_loop *) userp;
+    (void) multi;
+
+    if (timeout_ms < 0) {
+        loop->curl_timeout_at = 0;
+    } else {
+        loop->curl_timeout_at = gethrtime() + (hrtime_t) timeout_ms * 1000000;
+    }
+    return 0;
+}
+
+static void fill_conns(struct rest_loop *loop, struct rest_loop_handle *lh);
+
+static int race_width(conflate_handle_t *handle) {
+    return handle->conf->race_urls > 1 ? (int) handle->conf->race_urls : 1;
+}
+
+static void start_round(struct rest_loop *loop, struct rest_loop_handle *lh) {
+    lh->retry_at = 0;
+    lh->next_url = 0;
+    lh->winner = NULL;
+    lh->round_start_configs = lh->handle->tot_process_new_configs;
+    fill_conns(loop, lh);
+}
+
+static void end_round(struct rest_loop_handle *lh, bool succeeded) {
+    conflate_handle_t *handle = lh->handle;
+
+    if (!succeeded &&
+        lh->round_start_configs == handle->tot_process_new_configs) {
+        fprintf(stderr, "ERROR: could not contact REST server(s): %s\n",
+                handle->conf->host);
+    }
+
+    /* Don't overload the REST servers with tons of retries. */
+    lh->retry_at = gethrtime() + rest_round_delay(handle, succeeded,
+                                                  lh->round_start_configs);
+}
+
+static void cancel_others(struct rest_loop_handle *lh, struct rest_conn *keep) {
+    struct rest_conn *conn;
+
+    for (conn = lh->conns; conn; conn = conn->next) {
+        if (conn != keep) {
+            conn->cancelled = true;
+        }
+    }
+}
+
+static size_t conn_response(void *data, size_t s, size_t num, void *cb) {
+    struct rest_conn *conn = (struct rest_conn *) cb;
+    struct rest_loop_handle *lh = conn->lh;
+    int before = lh->handle->tot_process_new_configs;
+    size_t rv;
+
+    if (conn->cancelled) {
+        /* Aborts the transfer */
+        return 0;
+    }
+
+    rv = handle_response(data, s, num, &conn->stream);
+
+    /* The first connection to deliver a usable config wins the race.
+       We're inside a curl callback here, so the others are only marked
+       and get removed once control is back in the loop. */
+    if (lh->winner == NULL && lh->handle->tot_process_new_configs != before &&
+        conn->stream.last_result != CONFLATE_ERROR_BAD_SOURCE) {
+        lh->winner = conn;
+        lh->handle->url = conn->url->url;
+        cancel_others(lh, conn);
+    }
+
+    return rv;
+}
+
+static void free_conn(struct rest_loop *loop, struct rest_conn *conn) {
+    struct rest_loop_handle *lh = conn->lh;
+    struct rest_conn **pp;
+
+    for (pp = &lh->conns; *pp; pp = &(*pp)->next) {
+        if (*pp == conn) {
+            *pp = conn->next;
+            break;
+        }
+    }
+    lh->nconns--;
+    if (lh->winner == conn) {
+        lh->winner = NULL;
+    }
+
+    curl_multi_remove_handle(loop->multi, conn->curl);
+    curl_easy_cleanup(conn->curl);
+    destroy_stream(&conn->stream);
+    free(conn);
+}
+
+static bool start_conn(struct rest_loop *loop, struct rest_loop_handle *lh,
+                       struct rest_url *url) {
+    conflate_handle_t *handle = lh->handle;
+    struct rest_conn *conn = calloc(1, sizeof(struct rest_conn));
+    CURLMcode mc;
+
+    assert(conn);
+    conn->lh = lh;
+    conn->url = url;
+    conn->start_configs = handle->tot_process_new_configs;
+    init_stream(&conn->stream, handle);
+    conn->stream.url = url->url;
+
+    conn->curl = curl_easy_init();
+    assert(conn->curl);
+    curl_easy_setopt(conn->curl, CURLOPT_ERRORBUFFER, conn->curl_error_string);
+    curl_easy_setopt(conn->curl, CURLOPT_PRIVATE, conn);
+    setup_handle(conn->curl, url, handle->userpass, &conn->stream,
+                 handle_response);
+    curl_easy_setopt(conn->curl, CURLOPT_WRITEFUNCTION, conn_response);
+    curl_easy_setopt(conn->curl, CURLOPT_WRITEDATA, conn);
+
+    conn->next = lh->conns;
+    lh->conns = conn;
+    lh->nconns++;
+    if (lh->nconns == 1) {
+        handle->url = url->url;
+    }
+
+    mc = curl_multi_add_handle(loop->multi, conn->curl);
+    if (mc != CURLM_OK) {
+        fprintf(stderr, "WARNING: curl_multi_add_handle: %s\n",
+                curl_multi_strerror(mc));
+        free_conn(loop, conn);
+        return false;
+    }
+    return true;
+}
+
+static void fill_conns(struct rest_loop *loop, struct rest_loop_handle *lh) {
+    conflate_handle_t *handle = lh->handle;
+    hrtime_t now = gethrtime();
+
+    /* Keep up to race_urls transfers going until one of them wins,
+       skipping URLs that failed recently until their backoff expires */
+    while (lh->winner == NULL && lh->nconns < race_width(handle) &&
+           lh->next_url < handle->nurls) {
+        struct rest_url *url = &handle->urls[lh->next_url++];
+        if (rest_url_ready(url, now) && !start_conn(loop, lh, url)) {
+            rest_url_failed(handle, url);
+        }
+    }
+
+    if (lh->nconns == 0) {
+        end_round(lh, false);
+    }
+}
+
+static void transfer_done(struct rest_loop *loop, struct rest_conn *conn,
+                          CURLcode result) {
+    struct rest_loop_handle *lh = conn->lh;
+    conflate_handle_t *handle = lh->handle;
+    bool succeeded = false;
+
+    if (conn->cancelled) {
+        free_conn(loop, conn);
+        return;
+    }
+
+    if (result == CURLE_OK) {
+        /* We reach here if the REST server didn't provide a streaming
+           JSON response and so we need to process the just-one-JSON
+           response */
+        conflate_result r = finish_rest_transfer(conn->curl, &conn->stream,
+                                                 conn->url);
+        /* Restart at the beginning of the urls list on either a
+           success or a 'local' error, but only try the next url on
+           CONFLATE_ERROR_BAD_SOURCE. */
+        succeeded = (r == CONFLATE_SUCCESS || r == CONFLATE_ERROR);
+    } else {
+        fprintf(stderr, "WARNING: curl error: %s from: %s\n",
+                conn->curl_error_string, conn->url->url);
+    }
+
+    /* A stream that delivered configs before it broke was healthy, so
+       don't hold the failure against it. */
+    if (succeeded || handle->tot_process_new_configs != conn->start_configs) {
+        rest_url_succeeded(conn->url);
+    } else {
+        rest_url_failed(handle, conn->url);
+    }
+
+    free_conn(loop, conn);
+
+    if (succeeded) {
+        cancel_others(lh, NULL);
+        end_round(lh, true);
+    } else {
+        fill_conns(loop, lh);
+    }
+}
+
+static void reap_cancelled(struct rest_loop *loop) {
+    struct rest_loop_handle *lh;
+
+    for (lh = loop->handles; lh; lh = lh->next) {
+        struct rest_conn *conn = lh->conns;
+        while (conn) {
+            struct rest_conn *next = conn->next;
+            if (conn->cancelled) {
+                free_conn(loop, conn);
+            }
+            conn = next;
+        }
+    }
+}
+
+static void adopt_pending_handles(struct rest_loop *loop) {
+    conflate_handle_t **pending;
+    int npending, i;
+
+    cb_mutex_enter(&loop->mutex);
+    pending = loop->pending;
+    npending = loop->npending;
+    loop->pending = NULL;
+    loop->npending = 0;
+    cb_mutex_exit(&loop->mutex);
+
+    for (i = 0; i < npending; i++) {
+        struct rest_loop_handle *lh = calloc(1, sizeof(struct rest_loop_handle));
+        assert(lh);
+        lh->handle = pending[i];
+        init_rest_urls(lh->handle);
+
+        lh->next = loop->handles;
+        loop->handles = lh;
+
+        /* Before connecting and all that, load the stored config */
+        process_saved_config(lh->handle);
+
+        start_round(loop, lh);
+    }
+
+    free(pending);
+}
+
+static void check_multi_info(struct rest_loop *loop) {
+    CURLMsg *msg;
+    int left;
+
+    while ((msg = curl_multi_info_read(loop->multi, &left)) != NULL) {
+        if (msg->msg == CURLMSG_DONE) {
+            struct rest_conn *conn = NULL;
+            CURL *easy = msg->easy_handle;
+            CURLcode result = msg->data.result;
+
+            curl_easy_getinfo(easy, CURLINFO_PRIVATE, (char **) &conn);
+            assert(conn);
+            transfer_done(loop, conn, result);
+        }
+    }
+
+    reap_cancelled(loop);
+}
+
+static int next_timeout_ms(struct rest_loop *loop) {
+    hrtime_t now = gethrtime();
+    hrtime_t deadline = loop->curl_timeout_at;
+    struct rest_loop_handle *lh;
+
+    for (lh = loop->handles; lh; lh = lh->next) {
+        if (lh->retry_at && (deadline == 0 || lh->retry_at < deadline)) {
+            deadline = lh->retry_at;
+        }
+    }
+
+    if (deadline == 0) {
+        return -1;
+    }
+    if (deadline <= now) {
+        return 0;
+    }
+    /* Round up so we don't spin on sub-millisecond remainders. */
+    return (int) ((deadline - now + 999999) / 1000000);
+}
+
+static void run_timers(struct rest_loop *loop) {
+    hrtime_t now = gethrtime();
+    struct rest_loop_handle *lh;
+    int running;
+
+    if (loop->curl_timeout_at && loop->curl_timeout_at <= now) {
+        loop->curl_timeout_at = 0;
+        curl_multi_socket_action(loop->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+    }
+
+    for (lh = loop->handles; lh; lh = lh->next) {
+        if (lh->retry_at && lh->retry_at <= now) {
+            start_round(loop, lh);
+        }
+    }
+}
+
+static void run_rest_loop(void *arg) {
+    struct rest_loop *loop = (struct rest_loop *) arg;
+    struct epoll_event events[REST_LOOP_MAX_EVENTS];
+
+    while (true) {
+        int n, i, running;
+
+        adopt_pending_handles(loop);
+        run_timers(loop);
+        check_multi_info(loop);
+
+        n = epoll_wait(loop->epoll_fd, events, REST_LOOP_MAX_EVENTS,
+                       next_timeout_ms(loop));
+        if (n < 0) {
+            if (errno != EINTR) {
+                perror("epoll_wait");
+            }
+            continue;
+        }
+
+        for (i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            int flags = 0;
+
+            if (fd == loop->wakeup_fd[0]) {
+                char buf[64];
+                while (read(fd, buf, sizeof(buf)) > 0) {
+                    /* drain */
+                }
+                continue;
+            }
+
+            if (events[i].events & EPOLLIN) {
+                flags |= CURL_CSELECT_IN;
+            }
+            if (events[i].events & EPOLLOUT) {
+                flags |= CURL_CSELECT_OUT;
+            }
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                flags |= CURL_CSELECT_ERR;
+            }
+            curl_multi_socket_action(loop->multi, fd, flags, &running);
+        }
+
+        check_multi_info(loop);
+    }
+}
+
+static struct rest_loop *mk_rest_loop(bool own_thread) {
+    struct rest_loop *loop = calloc(1, sizeof(struct rest_loop));
+    struct epoll_event ev;
+    int i;
+
+    assert(loop);
+    cb_mutex_initialize(&loop->mutex);
+
+    loop->epoll_fd = epoll_create(REST_LOOP_MAX_EVENTS);
+    if (loop->epoll_fd < 0) {
+        perror("epoll_create");
+        free(loop);
+        return NULL;
+    }
+
+    if (pipe(loop->wakeup_fd) != 0) {
+        perror("pipe");
+        close(loop->epoll_fd);
+        free(loop);
+        return NULL;
+    }
+    for (i = 0; i < 2; i++) {
+        fcntl(loop->wakeup_fd[i], F_SETFL,
+              fcntl(loop->wakeup_fd[i], F_GETFL) | O_NONBLOCK);
+        fcntl(loop->wakeup_fd[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = loop->wakeup_fd[0];
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wakeup_fd[0], &ev) != 0) {
+        perror("epoll_ctl(ADD)");
+    }
+
+    loop->multi = curl_multi_init();
+    assert(loop->multi);
+    curl_multi_setopt(loop->multi, CURLMOPT_SOCKETFUNCTION, loop_socket_cb);
+    curl_multi_setopt(loop->multi, CURLMOPT_SOCKETDATA, loop);
+    curl_multi_setopt(loop->multi, CURLMOPT_TIMERFUNCTION, loop_timer_cb);
+    curl_multi_setopt(loop->multi, CURLMOPT_TIMERDATA, loop);
+
+    if (own_thread &&
+        cb_create_thread(&loop->thread, run_rest_loop, loop, 1) != 0) {
+        perror("Failed to create thread");
+        curl_multi_cleanup(loop->multi);
+        close(loop->wakeup_fd[0]);
+        close(loop->wakeup_fd[1]);
+        close(loop->epoll_fd);
+        free(loop);
+        return NULL;
+    }
+
+    return loop;
+}
+
+static void add_pending_handle(struct rest_loop *loop, conflate_handle_t *handle) {
+    conflate_handle_t **pending;
+    char c = 0;
+
+    cb_mutex_enter(&loop->mutex);
+    pending = realloc(loop->pending,
+                      sizeof(conflate_handle_t *) * (loop->npending + 1));
+    assert(pending);
+    pending[loop->npending++] = handle;
+    loop->pending = pending;
+    cb_mutex_exit(&loop->mutex);
+
+    if (write(loop->wakeup_fd[1], &c, 1) < 0 && errno != EAGAIN) {
+        perror("write");
+    }
+}
+
+static void init_shared_loop(void) {
+    shared_loop = mk_rest_loop(true);
+}
+
+bool rest_loop_add_handle(conflate_handle_t *handle) {
+    /* Handles may be started from several threads at once, and there
+       must only ever be one shared loop. */
+    conflate_once(&shared_loop_once, init_shared_loop);
+    if (shared_loop == NULL) {
+        return false;
+    }
+
+    add_pending_handle(shared_loop, handle);
+    return true;
+}
+
+bool rest_loop_run_handle(conflate_handle_t *handle) {
+    struct rest_loop *loop = mk_rest_loop(false);
+    if (loop == NULL) {
+        return false;
+    }
+
+    add_pending_handle(loop, handle);
+    run_rest_loop(loop);
+    return true;
+}
+
+#else /* !__linux__ */
+
+bool rest_loop_add_handle(conflate_handle_t *handle) {
+    (void) handle;
+    return false;
+}
+
+bool rest_loop_run_handle(conflate_handle_t *handle) {
+    (void) handle;
+    return false;
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,87 @@
+/*
+ * Timings of kvpair chain operations for chains of 10 to 1M pairs.
+ *
+ * Not part of the test suite; run tests_bench_kvpair by hand.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <platform/platform.h>
+#include <conflate.h>
+
+static double ms_since(hrtime_t start)
+{
+    return (double) (gethrtime() - start) / 1000000.0;
+}
+
+static void bench(int n)
+{
+    char *values[] = {"some reasonably sized value", NULL};
+    kvpair_builder_t builder;
+    kvpair_index_t *index;
+    kvpair_t *chain, *copy, *packed;
+    char key[32];
+    hrtime_t start;
+    int i;
+
+    printf("%8d pairs:", n);
+
+    start = gethrtime();
+    init_kvpair_builder(&builder);
+    for (i = 0; i < n; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        kvpair_builder_add(&builder, key, values);
+    }
+    chain = kvpair_builder_finish(&builder);
+    printf("  build %9.3fms", ms_since(start));
+
+    start = gethrtime();
+    copy = dup_kvpair(chain);
+    printf("  dup %9.3fms", ms_since(start));
+
+    start = gethrtime();
+    free_kvpair(copy);
+    printf("  free %9.3fms", ms_since(start));
+
+    start = gethrtime();
+    packed = dup_kvpair_packed(chain);
+    printf("  pack %9.3fms", ms_since(start));
+
+    start = gethrtime();
+    copy = dup_kvpair(packed);
+    printf("  dup packed %9.3fms", ms_since(start));
+
+    start = gethrtime();
+    free_kvpair(copy);
+    free_kvpair(packed);
+    printf("  free packed %9.3fms", ms_since(start) / 2);
+
+    snprintf(key, sizeof(key), "key%d", n - 1);
+    start = gethrtime();
+    if (find_kvpair(chain, key) == NULL) {
+        abort();
+    }
+    printf("  find last %9.3fms", ms_since(start));
+
+    index = mk_kvpair_index(chain);
+    start = gethrtime();
+    if (find_kvpair_indexed(index, key) == NULL) {
+        abort();
+    }
+    printf("  index+find %9.3fms\n", ms_since(start));
+    free_kvpair_index(index);
+
+    free_kvpair(chain);
+}
+
+int main(void)
+{
+    int n;
+
+    for (n = 10; n <= 1000000; n *= 10) {
+        bench(n);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <conflate.h>
+#include "conflate_internal.h"
+
+#include "test_common.h"
+
+static conflate_config_t conf;
+static conflate_handle_t handle;
+
+static void setup(void) {
+    init_conflate(&conf);
+    conf.keep_current_config = true;
+    memset(&handle, 0, sizeof(handle));
+    handle.conf = &conf;
+    init_config_delivery(&handle);
+    init_config_slot(&handle);
+}
+
+static void teardown(void) {
+}
+
+/* Takes any config but "bad". */
+static conflate_result picky_new_config(void *userdata, kvpair_t *config)
+{
+    (void)userdata;
+    return strcmp(get_simple_kvpair_val(config, CONFIG_KEY), "bad") == 0 ?
+        CONFLATE_ERROR : CONFLATE_SUCCESS;
+}
+
+static kvpair_t *mk_config(const char *value) {
+    char *values[2];
+    values[0] = (char *) value;
+    values[1] = NULL;
+    return mk_kvpair(CONFIG_KEY, values);
+}
+
+static void test_read_before_publish(void)
+{
+    conflate_reader_t *reader = conflate_register_reader(&handle);
+
+    fail_unless(conflate_read_begin(reader) == NULL,
+                "Found a config before any was published.");
+    conflate_read_end(reader);
+    conflate_unregister_reader(reader);
+}
+
+static void test_read_published(void)
+{
+    conflate_reader_t *reader = conflate_register_reader(&handle);
+    kvpair_t *kv = mk_config("one");
+    kvpair_t *current;
+
+    publish_config(&handle, kv);
+    free_kvpair(kv);
+
+    current = conflate_read_begin(reader);
+    fail_unless(current != NULL, "Didn't find the published config.");
+    fail_unless(strcmp(get_simple_kvpair_val(current, CONFIG_KEY), "one") == 0,
+                "Wrong config.");
+    conflate_read_end(reader);
+    conflate_unregister_reader(reader);
+}
+
+static void test_read_survives_publish(void)
+{
+    conflate_reader_t *reader = conflate_register_reader(&handle);
+    kvpair_t *kv = mk_config("one");
+    kvpair_t *current;
+    int i;
+
+    publish_config(&handle, kv);
+    free_kvpair(kv);
+
+    current = conflate_read_begin(reader);
+
+    /* Configs replaced while a read is open must stay around */
+    for (i = 0; i < 10; i++) {
+        kv = mk_config("newer");
+        publish_config(&handle, kv);
+        free_kvpair(kv);
+    }
+    fail_unless(strcmp(get_simple_kvpair_val(current, CONFIG_KEY), "one") == 0,
+                "Config changed under an open read.");
+    conflate_read_end(reader);
+
+    current = conflate_read_begin(reader);
+    fail_unless(strcmp(get_simple_kvpair_val(current, CONFIG_KEY), "newer") == 0,
+                "Didn't see the newest config.");
+    conflate_read_end(reader);
+    conflate_unregister_reader(reader);
+}
+
+static void test_readers_are_recycled(void)
+{
+    conflate_reader_t *first = conflate_register_reader(&handle);
+    conflate_reader_t *second;
+
+    conflate_unregister_reader(first);
+    second = conflate_register_reader(&handle);
+    fail_unless(first == second, "Reader wasn't reused.");
+    conflate_unregister_reader(second);
+}
+
+/* Deliver a config through the delivery thread and wait for it. */
+static void deliver_async(const char *value)
+{
+    char *copy = safe_strdup(value);
+    conflate_stats_t before, stats;
+    int i;
+
+    conflate_get_stats(&handle, &before);
+    deliver_config(&handle, copy, strlen(copy), NULL);
+    free(copy);
+    for (i = 0; i < 500; i++) {
+        conflate_get_stats(&handle, &stats);
+        if (stats.configs_delivered > before.configs_delivered) {
+            return;
+        }
+        usleep(10000);
+    }
+    fail_if(true, "Config wasn't delivered.");
+}
+
+static void test_rejected_async_config_not_published(void)
+{
+    conflate_reader_t *reader;
+    kvpair_t *current;
+
+    conf.new_config = picky_new_config;
+    conf.async_delivery = true;
+    cb_mutex_initialize(&handle.stats_lock);
+    init_config_history(&handle);
+    fail_unless(start_config_delivery(&handle),
+                "Couldn't start the delivery thread.");
+    deliver_async("good");
+    deliver_async("bad");
+    stop_config_delivery(&handle);
+
+    reader = conflate_register_reader(&handle);
+    current = conflate_read_begin(reader);
+    fail_unless(current != NULL, "The accepted config wasn't published.");
+    fail_unless(strcmp(get_simple_kvpair_val(current, CONFIG_KEY), "good") == 0,
+                "A rejected config was published.");
+    conflate_read_end(reader);
+    conflate_unregister_reader(reader);
+}
+
+int main(void)
+{
+    typedef void (*testcase)(void);
+    testcase tc[] = {
+        test_read_before_publish,
+        test_read_published,
+        test_read_survives_publish,
+        test_readers_are_recycled,
+        test_rejected_async_config_not_published,
+        NULL
+    };
+    int ii = 0;
+
+    while (tc[ii] != 0) {
+        setup();
+        tc[ii++]();
+        teardown();
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,320 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <conflate.h>
+#include "conflate_internal.h"
+
+#include "test_common.h"
+
+static conflate_config_t conf;
+static conflate_handle_t handle;
+static int deliveries;
+static char *delivered = NULL;
+
+/* The async_delivery handle and what its delivery thread saw. */
+static conflate_config_t async_conf;
+static conflate_handle_t async_handle;
+static cb_mutex_t gate_lock;
+static cb_cond_t gate_cond;
+static bool gate_closed;
+static bool in_callback;
+static int async_deliveries;
+static int released;
+static char async_received[256];
+
+static conflate_result new_config(void *userdata, kvpair_t *config)
+{
+    (void)userdata;
+    deliveries++;
+    free(delivered);
+    delivered = safe_strdup(get_simple_kvpair_val(config, CONFIG_KEY));
+    return CONFLATE_SUCCESS;
+}
+
+static void setup(void) {
+    init_conflate(&conf);
+    conf.new_config = new_config;
+    memset(&handle, 0, sizeof(handle));
+    handle.conf = &conf;
+    cb_mutex_initialize(&handle.stats_lock);
+    init_config_delivery(&handle);
+    init_config_slot(&handle);
+    init_config_history(&handle);
+    deliveries = 0;
+}
+
+static void teardown(void) {
+    free(delivered);
+    delivered = NULL;
+}
+
+/* A config as the REST source would deliver it. */
+static conflate_result deliver(const char *config) {
+    char *copy = safe_strdup(config);
+    conflate_result r = deliver_config(&handle, copy, strlen(copy), NULL);
+    free(copy);
+    return r;
+}
+
+static void test_unchanged_delivered_by_default(void)
+{
+    deliver("{\"rev\":1}");
+    deliver("{\"rev\":1}");
+    fail_unless(deliveries == 2, "A resent config was skipped.");
+}
+
+static void test_skip_unchanged(void)
+{
+    conflate_stats_t stats;
+
+    conf.skip_unchanged_configs = true;
+    fail_unless(deliver("{\"rev\":1}") == CONFLATE_SUCCESS,
+                "First config failed.");
+    fail_unless(deliver("{\"rev\":1}") == CONFLATE_SUCCESS,
+                "Skipped config failed.");
+    fail_unless(deliveries == 1, "An unchanged config was delivered.");
+
+    conflate_get_stats(&handle, &stats);
+    fail_unless(stats.configs_unchanged == 1, "Skipped config not counted.");
+    fail_unless(stats.configs_delivered == 1, "Wrong delivery count.");
+}
+
+static void test_skip_unchanged_delivers_changes(void)
+{
+    conf.skip_unchanged_configs = true;
+    deliver("{\"rev\":1}");
+    deliver("{\"rev\":2}");
+    fail_unless(deliveries == 2, "A changed config was skipped.");
+    fail_unless(strcmp(delivered, "{\"rev\":2}") == 0,
+                "Delivered the wrong config.");
+
+    /* A config that only differs in length isn't the same either. */
+    deliver("{\"rev\":2} ");
+    fail_unless(deliveries == 3, "A longer config was skipped.");
+
+    /* Going back to an older config is a change too. */
+    deliver("{\"rev\":1}");
+    fail_unless(deliveries == 4, "A reverted config was skipped.");
+}
+
+/* Rejects configs marked bad, and waits while the gate is closed. */
+static conflate_result gated_new_config(void *userdata, kvpair_t *config)
+{
+    const char *value = get_simple_kvpair_val(config, CONFIG_KEY);
+    (void)userdata;
+    cb_mutex_enter(&gate_lock);
+    strcat(async_received, value);
+    strcat(async_received, "|");
+    in_callback = true;
+    cb_cond_broadcast(&gate_cond);
+    while (gate_closed) {
+        cb_cond_wait(&gate_cond, &gate_lock);
+    }
+    async_deliveries++;
+    cb_cond_broadcast(&gate_cond);
+    cb_mutex_exit(&gate_lock);
+    return strstr(value, "bad") ? CONFLATE_ERROR : CONFLATE_SUCCESS;
+}
+
+static void count_release(void *backing, size_t size)
+{
+    (void)backing;
+    (void)size;
+    cb_mutex_enter(&gate_lock);
+    released++;
+    cb_cond_broadcast(&gate_cond);
+    cb_mutex_exit(&gate_lock);
+}
+
+/* A config whose release is counted when it's freed. */
+static kvpair_t *mk_counted_config(const char *value)
+{
+    char **values;
+    kvpair_t *kv = mk_kvpair_view(1, 1, &values, (void *) value,
+                                  strlen(value) + 1, count_release);
+    kv->key = CONFIG_KEY;
+    kv->values = values;
+    values[0] = (char *) value;
+    values[1] = NULL;
+    return kv;
+}
+
+/* Start the async_delivery handle, its gate closed or not. */
+static void start_async(bool closed)
+{
+    init_conflate(&async_conf);
+    async_conf.new_config = gated_new_config;
+    async_conf.async_delivery = true;
+    memset(&async_handle, 0, sizeof(async_handle));
+    async_handle.conf = &async_conf;
+    cb_mutex_initialize(&async_handle.stats_lock);
+    init_config_delivery(&async_handle);
+    init_config_slot(&async_handle);
+    init_config_history(&async_handle);
+    cb_mutex_initialize(&gate_lock);
+    cb_cond_initialize(&gate_cond);
+    gate_closed = closed;
+    in_callback = false;
+    async_deliveries = 0;
+    released = 0;
+    async_received[0] = '\0';
+    fail_unless(start_config_delivery(&async_handle),
+                "Couldn't start the delivery thread.");
+}
+
+static void deliver_async(const char *config)
+{
+    char *copy = safe_strdup(config);
+    deliver_config(&async_handle, copy, strlen(copy), NULL);
+    free(copy);
+}
+
+/* Wait for new_config to have returned n times. */
+static void wait_for_async(int n)
+{
+    cb_mutex_enter(&gate_lock);
+    while (async_deliveries < n) {
+        cb_cond_wait(&gate_cond, &gate_lock);
+    }
+    cb_mutex_exit(&gate_lock);
+    /* Let the delivery thread finish with the config. */
+    cb_mutex_enter(&async_handle.delivery_lock);
+    while (async_handle.delivering) {
+        cb_mutex_exit(&async_handle.delivery_lock);
+        usleep(1000);
+        cb_mutex_enter(&async_handle.delivery_lock);
+    }
+    cb_mutex_exit(&async_handle.delivery_lock);
+}
+
+static void test_async_coalescing(void)
+{
+    conflate_stats_t stats;
+
+    start_async(true);
+
+    /* Hold the delivery thread in new_config with the first config. */
+    queue_config(&async_handle, mk_counted_config("one"), 0, 0);
+    cb_mutex_enter(&gate_lock);
+    while (!in_callback) {
+        cb_cond_wait(&gate_cond, &gate_lock);
+    }
+    cb_mutex_exit(&gate_lock);
+
+    queue_config(&async_handle, mk_counted_config("two"), 0, 0);
+    queue_config(&async_handle, mk_counted_config("three"), 0, 0);
+    queue_config(&async_handle, mk_counted_config("four"), 0, 0);
+
+    cb_mutex_enter(&gate_lock);
+    fail_unless(released == 2, "Superseded configs weren't freed.");
+    gate_closed = false;
+    cb_cond_broadcast(&gate_cond);
+    while (async_deliveries < 2 || released < 4) {
+        cb_cond_wait(&gate_cond, &gate_lock);
+    }
+    fail_unless(strcmp(async_received, "one|four|") == 0,
+                "Didn't deliver just the newest config.");
+    cb_mutex_exit(&gate_lock);
+
+    conflate_get_stats(&async_handle, &stats);
+    fail_unless(stats.configs_coalesced == 2, "Coalesced configs not counted.");
+
+    stop_config_delivery(&async_handle);
+    fail_if(async_handle.delivery_started, "Delivery thread still running.");
+}
+
+static void test_async_skip_unchanged_rejected(void)
+{
+    conflate_stats_t stats;
+
+    start_async(false);
+    async_conf.skip_unchanged_configs = true;
+
+    deliver_async("{\"rev\":1}");
+    wait_for_async(1);
+    deliver_async("{\"rev\":\"bad\"}");
+    wait_for_async(2);
+
+    /* The rejected config isn't the current one, so a resend of it
+       is another try while a resend of the current one is skipped. */
+    deliver_async("{\"rev\":\"bad\"}");
+    conflate_get_stats(&async_handle, &stats);
+    fail_unless(stats.configs_unchanged == 0, "Rejected config skipped.");
+    wait_for_async(3);
+    deliver_async("{\"rev\":1}");
+    deliver_async("{\"rev\":2}");
+    wait_for_async(4);
+
+    cb_mutex_enter(&gate_lock);
+    fail_unless(strcmp(async_received, "{\"rev\":1}|{\"rev\":\"bad\"}|"
+                       "{\"rev\":\"bad\"}|{\"rev\":2}|") == 0,
+                "Rejected config remembered as the current one.");
+    cb_mutex_exit(&gate_lock);
+
+    stop_config_delivery(&async_handle);
+}
+
+static void test_async_skip_unchanged_in_flight(void)
+{
+    start_async(false);
+    async_conf.skip_unchanged_configs = true;
+
+    deliver_async("{\"rev\":1}");
+    wait_for_async(1);
+
+    /* While another config is in new_config, going back to the
+       current one is a change. */
+    cb_mutex_enter(&gate_lock);
+    gate_closed = true;
+    in_callback = false;
+    cb_mutex_exit(&gate_lock);
+    deliver_async("{\"rev\":2}");
+    cb_mutex_enter(&gate_lock);
+    while (!in_callback) {
+        cb_cond_wait(&gate_cond, &gate_lock);
+    }
+    cb_mutex_exit(&gate_lock);
+
+    deliver_async("{\"rev\":1}");
+    fail_if(async_handle.pending_config == NULL,
+            "Config skipped while another was being delivered.");
+
+    cb_mutex_enter(&gate_lock);
+    gate_closed = false;
+    cb_cond_broadcast(&gate_cond);
+    cb_mutex_exit(&gate_lock);
+    wait_for_async(3);
+
+    cb_mutex_enter(&gate_lock);
+    fail_unless(strcmp(async_received,
+                       "{\"rev\":1}|{\"rev\":2}|{\"rev\":1}|") == 0,
+                "Didn't go back to the first config.");
+    cb_mutex_exit(&gate_lock);
+
+    stop_config_delivery(&async_handle);
+}
+
+int main(void)
+{
+    typedef void (*testcase)(void);
+    testcase tc[] = {
+        test_unchanged_delivered_by_default,
+        test_skip_unchanged,
+        test_skip_unchanged_delivers_changes,
+        test_async_coalescing,
+        test_async_skip_unchanged_rejected,
+        test_async_skip_unchanged_in_flight,
+        NULL
+    };
+    int ii = 0;
+
+    while (tc[ii] != 0) {
+        setup();
+        tc[ii++]();
+        teardown();
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <conflate.h>
+#include "conflate_internal.h"
+
+#include "test_common.h"
+
+#define SOURCE_DIR "check_file_source.d"
+#define SOURCE_FILE SOURCE_DIR "/config"
+
+static cb_mutex_t delivery_lock;
+static char *delivered = NULL;
+static int warnings;
+
+static void counting_logger(void *userdata, enum conflate_log_level lvl,
+                            const char *msg, ...)
+{
+    (void)userdata;
+    (void)msg;
+    if (lvl == LOG_LVL_WARN) {
+        cb_mutex_enter(&delivery_lock);
+        warnings++;
+        cb_mutex_exit(&delivery_lock);
+    }
+}
+
+/* Takes every config except those marked bad. */
+static conflate_result new_config(void *userdata, kvpair_t *config)
+{
+    const char *value = get_simple_kvpair_val(config, CONFIG_KEY);
+    (void)userdata;
+    if (strstr(value, "bad") != NULL) {
+        return CONFLATE_ERROR;
+    }
+    cb_mutex_enter(&delivery_lock);
+    free(delivered);
+    delivered = safe_strdup(value);
+    cb_mutex_exit(&delivery_lock);
+    return CONFLATE_SUCCESS;
+}
+
+static void write_file(const char *path, const char *contents)
+{
+    FILE *fp = fopen(path, "wb");
+    fail_if(fp == NULL, "Can't write the config file.");
+    fputs(contents, fp);
+    fclose(fp);
+}
+
+/* Publish a config the atomic way, renaming it over the old one. */
+static void replace_file(const char *contents)
+{
+    write_file(SOURCE_DIR "/config.tmp", contents);
+    fail_unless(rename(SOURCE_DIR "/config.tmp", SOURCE_FILE) == 0,
+                "Can't rename the config file.");
+}
+
+/* Wait (up to five seconds) for the given config to be delivered. */
+static void wait_for(const char *config)
+{
+    int i;
+
+    for (i = 0; i < 500; i++) {
+        bool found;
+        cb_mutex_enter(&delivery_lock);
+        found = delivered != NULL && strcmp(delivered, config) == 0;
+        cb_mutex_exit(&delivery_lock);
+        if (found) {
+            return;
+        }
+        usleep(10000);
+    }
+    fail_if(true, "Config wasn't delivered.");
+}
+
+/* Wait (up to five seconds) for a warning to be logged. */
+static void wait_for_warning(void)
+{
+    int i;
+
+    for (i = 0; i < 500; i++) {
+        bool found;
+        cb_mutex_enter(&delivery_lock);
+        found = warnings > 0;
+        cb_mutex_exit(&delivery_lock);
+        if (found) {
+            return;
+        }
+        usleep(10000);
+    }
+    fail_if(true, "Rejected config wasn't logged.");
+}
+
+static void test_file_source(void)
+{
+    conflate_config_t conf;
+
+    cb_mutex_initialize(&delivery_lock);
+    mkdir(SOURCE_DIR, 0755);
+    replace_file("{\"rev\":1}");
+
+    init_conflate(&conf);
+    conf.jid = "";
+    conf.pass = "";
+    conf.host = "file:" SOURCE_FILE;
+    conf.software = "check_file_source";
+    conf.version = "1";
+    conf.save_path = "";
+    conf.log = counting_logger;
+    conf.new_config = new_config;
+    conf.poll_interval_ms = 10;
+    fail_if(start_conflate_handle(conf) == NULL, "Couldn't start the handle.");
+    wait_for("{\"rev\":1}");
+
+    replace_file("{\"rev\":2}");
+    wait_for("{\"rev\":2}");
+
+    write_file(SOURCE_FILE, "{\"rev\":3}");
+    wait_for("{\"rev\":3}");
+
+    /* Replacing the whole directory mustn't lose track of the file. */
+    remove(SOURCE_FILE);
+    fail_unless(rmdir(SOURCE_DIR) == 0, "Can't remove the directory.");
+    fail_unless(mkdir(SOURCE_DIR, 0755) == 0, "Can't recreate the directory.");
+    replace_file("{\"rev\":4}");
+    wait_for("{\"rev\":4}");
+
+    replace_file("{\"rev\":5}");
+    wait_for("{\"rev\":5}");
+
+    /* A config the application rejects is logged, not kept. */
+    cb_mutex_enter(&delivery_lock);
+    warnings = 0;
+    cb_mutex_exit(&delivery_lock);
+    replace_file("{\"rev\":\"bad\"}");
+    wait_for_warning();
+    wait_for("{\"rev\":5}");
+
+    replace_file("{\"rev\":6}");
+    wait_for("{\"rev\":6}");
+
+    remove(SOURCE_FILE);
+    rmdir(SOURCE_DIR);
+}
+
+int main(void)
+{
+    typedef void (*testcase)(void);
+    testcase tc[] = {
+        test_file_source,
+        NULL
+    };
+    int ii = 0;
+
+    while (tc[ii] != 0) {
+        tc[ii++]();
+    }
+
+    return EXIT_SUCCESS;
+}
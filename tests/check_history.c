@@ -0,0 +1,307 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <conflate.h>
+#include "conflate_internal.h"
+
+#include "test_common.h"
+
+#define SAVE_PATH "check_history.cfg"
+#define MAX_ENTRIES 16
+
+static conflate_config_t conf;
+static conflate_handle_t handle;
+static char *delivered = NULL;
+static conflate_result delivery_result;
+
+static void quiet_logger(void *userdata, enum conflate_log_level lvl,
+                         const char *msg, ...)
+{
+    (void)userdata;
+    (void)lvl;
+    (void)msg;
+}
+
+static conflate_result new_config(void *userdata, kvpair_t *config)
+{
+    (void)userdata;
+    free(delivered);
+    delivered = safe_strdup(get_simple_kvpair_val(config, CONFIG_KEY));
+    return delivery_result;
+}
+
+/* A fresh handle, as a restarted process would have. */
+static void reset_handle(void) {
+    memset(&handle, 0, sizeof(handle));
+    handle.conf = &conf;
+    cb_mutex_initialize(&handle.stats_lock);
+    init_config_delivery(&handle);
+    init_config_slot(&handle);
+    init_config_history(&handle);
+}
+
+static void clear_history(void) {
+    conflate_history_entry_t entries[MAX_ENTRIES];
+    size_t n = conflate_get_history(&handle, entries, MAX_ENTRIES);
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), SAVE_PATH ".history.%016llx",
+                 (unsigned long long) entries[i].hash);
+        remove(path);
+    }
+    remove(SAVE_PATH ".history");
+    remove(SAVE_PATH);
+}
+
+static void setup(void) {
+    init_conflate(&conf);
+    conf.log = quiet_logger;
+    conf.new_config = new_config;
+    conf.save_path = SAVE_PATH;
+    conf.history_max_configs = 4;
+    delivery_result = CONFLATE_SUCCESS;
+    reset_handle();
+    clear_history();
+    reset_handle();
+}
+
+static void teardown(void) {
+    clear_history();
+    free(delivered);
+    delivered = NULL;
+}
+
+/* A config as the REST source would deliver it. */
+static void deliver(const char *config) {
+    char *copy = safe_strdup(config);
+    deliver_config(&handle, copy, strlen(copy), NULL);
+    free(copy);
+}
+
+static void test_history_order(void)
+{
+    conflate_history_entry_t entries[MAX_ENTRIES];
+    size_t n;
+
+    deliver("{\"rev\":1}");
+    deliver("{\"rev\":2}");
+    deliver("{\"rev\":3}");
+
+    n = conflate_get_history(&handle, entries, MAX_ENTRIES);
+    fail_unless(n == 3, "Wrong number of configs in the history.");
+    fail_unless(conflate_redeliver_config(&handle, entries[2].hash) ==
+                CONFLATE_SUCCESS, "Rollback failed.");
+    fail_unless(strcmp(delivered, "{\"rev\":1}") == 0,
+                "Rolled back to the wrong config.");
+
+    /* The rolled back config is the current one now. */
+    n = conflate_get_history(&handle, entries, MAX_ENTRIES);
+    fail_unless(n == 3, "Rollback changed the number of configs.");
+    fail_unless(conflate_redeliver_config(&handle, entries[1].hash) ==
+                CONFLATE_SUCCESS, "Rollback failed.");
+    fail_unless(strcmp(delivered, "{\"rev\":3}") == 0,
+                "History order is wrong after a rollback.");
+}
+
+static void test_history_dedup(void)
+{
+    conflate_history_entry_t entries[MAX_ENTRIES];
+
+    deliver("{\"rev\":1}");
+    deliver("{\"rev\":2}");
+    deliver("{\"rev\":1}");
+
+    fail_unless(conflate_get_history(&handle, entries, MAX_ENTRIES) == 2,
+                "A config was kept twice.");
+}
+
+static void test_history_count_limit(void)
+{
+    conflate_history_entry_t entries[MAX_ENTRIES];
+    char config[32];
+    char path[64];
+    FILE *fp;
+    int i;
+
+    for (i = 0; i < 10; i++) {
+        snprintf(config, sizeof(config), "{\"rev\":%d}", i);
+        deliver(config);
+    }
+    fail_unless(conflate_get_history(&handle, entries, MAX_ENTRIES) == 4,
+                "The history wasn't trimmed.");
+
+    snprintf(path, sizeof(path), SAVE_PATH ".history.%016llx",
+             (unsigned long long) entries[3].hash);
+    fp = fopen(path, "rb");
+    fail_if(fp == NULL, "A kept config is missing.");
+    fclose(fp);
+}
+
+static void test_history_byte_limit(void)
+{
+    conflate_history_entry_t entries[MAX_ENTRIES];
+    size_t n;
+
+    deliver("{\"rev\":1}");
+    n = conflate_get_history(&handle, entries, MAX_ENTRIES);
+    fail_unless(n == 1, "Config not kept.");
+
+    conf.history_max_bytes = entries[0].stored_size;
+    deliver("{\"rev\":2}");
+    n = conflate_get_history(&handle, entries, MAX_ENTRIES);
+    fail_unless(n == 1, "The history went over its byte limit.");
+    fail_unless(conflate_redeliver_config(&handle, entries[0].hash) ==
+                CONFLATE_SUCCESS, "Rollback failed.");
+    fail_unless(strcmp(delivered, "{\"rev\":2}") == 0,
+                "The newest config wasn't kept.");
+}
+
+static void test_history_compressed(void)
+{
+    conflate_history_entry_t entries[MAX_ENTRIES];
+    char *config = malloc(65536);
+    int i;
+
+    for (i = 0; i < 65535; i++) {
+        config[i] = "abcd"[i % 4];
+    }
+    config[65535] = '\0';
+    deliver(config);
+
+    fail_unless(conflate_get_history(&handle, entries, MAX_ENTRIES) == 1,
+                "Config not kept.");
+#ifdef HAVE_ZLIB
+    fail_unless(entries[0].stored_size < entries[0].size / 4,
+                "Config wasn't compressed.");
+#endif
+    deliver("{\"rev\":2}");
+    fail_unless(conflate_redeliver_config(&handle, entries[0].hash) ==
+                CONFLATE_SUCCESS, "Rollback failed.");
+    fail_unless(strcmp(delivered, config) == 0, "Config changed in the history.");
+    free(config);
+}
+
+static void test_history_reload(void)
+{
+    conflate_history_entry_t entries[MAX_ENTRIES];
+
+    deliver("{\"rev\":1}");
+    deliver("{\"rev\":2}");
+
+    reset_handle();
+
+    fail_unless(conflate_get_history(&handle, entries, MAX_ENTRIES) == 2,
+                "History lost on restart.");
+    fail_unless(conflate_redeliver_config(&handle, entries[1].hash) ==
+                CONFLATE_SUCCESS, "Rollback failed.");
+    fail_unless(strcmp(delivered, "{\"rev\":1}") == 0,
+                "Rolled back to the wrong config.");
+}
+
+static void test_history_rejected(void)
+{
+    conflate_history_entry_t entries[MAX_ENTRIES];
+
+    deliver("{\"rev\":1}");
+    delivery_result = CONFLATE_ERROR;
+    deliver("{\"rev\":2}");
+
+    fail_unless(conflate_get_history(&handle, entries, MAX_ENTRIES) == 1,
+                "A rejected config was kept.");
+    fail_unless(conflate_redeliver_config(&handle, 42) == CONFLATE_ERROR,
+                "Rolled back to a config that was never kept.");
+}
+
+static void test_history_rollback_then_resend(void)
+{
+    conflate_history_entry_t entries[MAX_ENTRIES];
+    conflate_stats_t stats;
+
+    conf.skip_unchanged_configs = true;
+    deliver("{\"rev\":1}");
+    deliver("{\"rev\":2}");
+    fail_unless(conflate_get_history(&handle, entries, MAX_ENTRIES) == 2,
+                "Wrong number of configs in the history.");
+    fail_unless(conflate_redeliver_config(&handle, entries[1].hash) ==
+                CONFLATE_SUCCESS, "Rollback failed.");
+
+    /* The rolled back config is current: resending it is skipped,
+       while the source resending the newer one undoes the rollback. */
+    deliver("{\"rev\":1}");
+    conflate_get_stats(&handle, &stats);
+    fail_unless(stats.configs_unchanged == 1,
+                "The rolled back config wasn't the current one.");
+    deliver("{\"rev\":2}");
+    fail_unless(strcmp(delivered, "{\"rev\":2}") == 0,
+                "The source's config was skipped after a rollback.");
+}
+
+/* Wait for the delivery thread to have called new_config n times. */
+static void wait_for_deliveries(uint64_t n) {
+    conflate_stats_t stats;
+    int i;
+
+    for (i = 0; i < 500; i++) {
+        conflate_get_stats(&handle, &stats);
+        if (stats.configs_delivered >= n) {
+            return;
+        }
+        usleep(10000);
+    }
+    fail_if(true, "Config wasn't delivered.");
+}
+
+static void test_history_rejected_async(void)
+{
+    conflate_history_entry_t entries[MAX_ENTRIES];
+    kvpair_t *saved;
+
+    conf.async_delivery = true;
+    fail_unless(start_config_delivery(&handle),
+                "Couldn't start the delivery thread.");
+    deliver("{\"rev\":1}");
+    wait_for_deliveries(1);
+    delivery_result = CONFLATE_ERROR;
+    deliver("{\"rev\":2}");
+    wait_for_deliveries(2);
+    stop_config_delivery(&handle);
+
+    fail_unless(conflate_get_history(&handle, entries, MAX_ENTRIES) == 1,
+                "A rejected config was kept.");
+    saved = load_kvpairs(&handle, SAVE_PATH);
+    fail_if(saved == NULL, "The accepted config wasn't saved.");
+    fail_unless(strcmp(get_simple_kvpair_val(saved, CONFIG_KEY),
+                       "{\"rev\":1}") == 0,
+                "A rejected config was saved.");
+    free_kvpair(saved);
+}
+
+int main(void)
+{
+    typedef void (*testcase)(void);
+    testcase tc[] = {
+        test_history_order,
+        test_history_dedup,
+        test_history_count_limit,
+        test_history_byte_limit,
+        test_history_compressed,
+        test_history_reload,
+        test_history_rejected,
+        test_history_rollback_then_resend,
+        test_history_rejected_async,
+        NULL
+    };
+    int ii = 0;
+
+    while (tc[ii] != 0) {
+        setup();
+        tc[ii++]();
+        teardown();
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -88,6 +88,27 @@ static void test_add_value_to_existing_values(void)
     fail_unless(strcmp(pair->values[3], "newvalue2") == 0, "Unexpected value at 3");
 }
 
+static void test_mk_pair_borrowed(void)
+{
+    char value[] = "borrowed";
+    char* args[] = {value, NULL};
+    kvpair_t *copy;
+    pair = mk_kvpair_borrowed("some_key", args);
+
+    fail_if(pair == NULL, "Didn't create a pair.");
+    fail_unless(strcmp(pair->key, "some_key") == 0, "Key is broken.");
+    fail_unless(pair->values[0] == value, "Value was copied.");
+    fail_unless(pair->values[1] == NULL, "Values aren't terminated.");
+    fail_unless(pair->used_values == 1, "Wrong number of used values.");
+
+    copy = dup_kvpair(pair);
+    fail_if(copy->values[0] == value, "Copy borrowed the value.");
+    check_pair_equality(pair, copy);
+    free_kvpair(copy);
+
+    /* teardown() frees the pair, which must leave value alone */
+}
+
 static void test_find_from_null(void)
 {
     fail_unless(find_kvpair(NULL, "some_key") == NULL, "Couldn't find from NULL.");
@@ -152,6 +173,77 @@ static void test_simple_find_missing_item(void)
                 "Negative search failed.");
 }
 
+static void test_indexed_find_from_null(void)
+{
+    kvpair_index_t *index = mk_kvpair_index(NULL);
+    fail_unless(find_kvpair_indexed(index, "some_key") == NULL,
+                "Couldn't find from NULL.");
+    free_kvpair_index(index);
+}
+
+static void test_indexed_find_many(void)
+{
+    kvpair_index_t *index;
+    kvpair_t *p;
+    char key[32];
+    int i;
+
+    for (i = 0; i < 500; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        p = mk_kvpair(key, NULL);
+        p->next = pair;
+        pair = p;
+    }
+
+    index = mk_kvpair_index(pair);
+    for (i = 0; i < 500; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        fail_unless(find_kvpair_indexed(index, key) == find_kvpair(pair, key),
+                    "Indexed search disagrees with find_kvpair.");
+    }
+    fail_unless(find_kvpair_indexed(index, "missing_key") == NULL,
+                "Negative search failed.");
+    free_kvpair_index(index);
+}
+
+static void test_indexed_find_first_duplicate(void)
+{
+    char *val1[2] = { "first", NULL };
+    char *val2[2] = { "second", NULL };
+    kvpair_index_t *index;
+
+    pair = mk_kvpair("some_key", val1);
+    pair->next = mk_kvpair("some_key", val2);
+
+    index = mk_kvpair_index(pair);
+    fail_unless(strcmp(get_simple_kvpair_val_indexed(index, "some_key"),
+                       "first") == 0, "Didn't find the first match.");
+    free_kvpair_index(index);
+}
+
+static void test_indexed_find_after_invalidate(void)
+{
+    char *val[2] = { "someval", NULL };
+    kvpair_index_t *index;
+    kvpair_t *p;
+
+    pair = mk_kvpair("some_key", NULL);
+    index = mk_kvpair_index(pair);
+    fail_unless(find_kvpair_indexed(index, "new_key") == NULL,
+                "Found a key before it was added.");
+
+    p = mk_kvpair("new_key", val);
+    p->next = pair;
+    pair = p;
+    invalidate_kvpair_index(index, pair);
+
+    fail_unless(strcmp(get_simple_kvpair_val_indexed(index, "new_key"),
+                       "someval") == 0, "Didn't see the new key.");
+    fail_unless(find_kvpair_indexed(index, "some_key") == pair->next,
+                "Lost the old key.");
+    free_kvpair_index(index);
+}
+
 static void test_copy_pair(void)
 {
     char *args1[] = {"arg1", "arg2", NULL};
@@ -192,6 +284,111 @@ static bool walk_incr_count_false(void *opaque,
     return false;
 }
 
+static void test_copy_pair_packed(void)
+{
+    char *args1[] = {"arg1", "arg2", NULL};
+    char *args2[] = {"other", NULL};
+    kvpair_t *packed, *copy;
+
+    pair = mk_kvpair("some_key", args1);
+    pair->next = mk_kvpair("other_key", args2);
+    pair->next->next = mk_kvpair("empty_key", NULL);
+
+    packed = dup_kvpair_packed(pair);
+    check_pair_equality(pair, packed);
+    fail_unless(get_simple_kvpair_val(packed, "other_key") != args2[0],
+                "Packed copy borrowed a value.");
+
+    /* Copying a packed chain rebases all its pointers */
+    copy = dup_kvpair(packed);
+    free_kvpair(packed);
+    check_pair_equality(pair, copy);
+    fail_unless(find_kvpair(copy, "empty_key")->values[0] == NULL,
+                "Empty values aren't terminated.");
+    free_kvpair(copy);
+}
+
+static void test_packed_pair_with_tail(void)
+{
+    char *args[] = {"val", NULL};
+    kvpair_t *packed, *copy;
+
+    pair = mk_kvpair("some_key", args);
+    packed = dup_kvpair_packed(pair);
+
+    /* Ordinary pairs chained after a packed block are freed with it */
+    packed->next = mk_kvpair("tail_key", args);
+    copy = dup_kvpair(packed);
+    fail_unless(strcmp(get_simple_kvpair_val(copy, "tail_key"), "val") == 0,
+                "Lost the tail of a packed chain.");
+    free_kvpair(copy);
+    free_kvpair(packed);
+}
+
+static void test_retain_snapshot(void)
+{
+    char *args[] = {"val", NULL};
+    kvpair_t *snapshot, *ref;
+
+    pair = mk_kvpair("some_key", args);
+
+    /* Retaining an ordinary chain snapshots it */
+    snapshot = kvpair_retain(pair);
+    fail_if(snapshot == pair, "Retained the original chain.");
+    check_pair_equality(pair, snapshot);
+
+    /* Retaining a snapshot shares it */
+    ref = kvpair_retain(snapshot);
+    fail_unless(ref == snapshot, "Copied a snapshot.");
+
+    kvpair_release(snapshot);
+    fail_unless(strcmp(get_simple_kvpair_val(ref, "some_key"), "val") == 0,
+                "Snapshot went away with a reference left.");
+    kvpair_release(ref);
+}
+
+static void test_builder_keeps_order(void)
+{
+    char *args[] = {"val", NULL};
+    kvpair_builder_t builder;
+    kvpair_t *p;
+    char key[32];
+    int i;
+
+    init_kvpair_builder(&builder);
+    fail_unless(kvpair_builder_finish(&builder) == NULL,
+                "Empty builder made a chain.");
+
+    for (i = 0; i < 100; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        kvpair_builder_add(&builder, key, args);
+    }
+    pair = kvpair_builder_finish(&builder);
+
+    for (p = pair, i = 0; p; p = p->next, i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        fail_unless(strcmp(p->key, key) == 0, "Pairs out of order.");
+    }
+    fail_unless(i == 100, "Wrong number of pairs.");
+}
+
+static void test_long_chain(void)
+{
+    kvpair_builder_t builder;
+    kvpair_t *copy;
+    int i;
+
+    /* Deep enough to overflow the stack if anything recursed. */
+    init_kvpair_builder(&builder);
+    for (i = 0; i < 1000000; i++) {
+        kvpair_builder_add(&builder, "k", NULL);
+    }
+    pair = kvpair_builder_finish(&builder);
+
+    copy = dup_kvpair(pair);
+    free_kvpair(copy);
+}
+
 static void test_walk_true(void)
 {
     char *args1[] = {"arg1", "arg2", NULL};
@@ -230,6 +427,7 @@ int main(void)
         test_mk_pair_without_arg,
         test_add_value_to_existing_values,
         test_add_value_to_empty_values,
+        test_mk_pair_borrowed,
         test_find_from_null,
         test_find_first_item,
         test_find_second_item,
@@ -238,7 +436,16 @@ int main(void)
         test_simple_find_first_item,
         test_simple_find_second_item,
         test_simple_find_missing_item,
+        test_indexed_find_from_null,
+        test_indexed_find_many,
+        test_indexed_find_first_duplicate,
+        test_indexed_find_after_invalidate,
         test_copy_pair,
+        test_copy_pair_packed,
+        test_packed_pair_with_tail,
+        test_retain_snapshot,
+        test_builder_keeps_order,
+        test_long_chain,
         test_walk_true,
         test_walk_false,
         NULL
@@ -0,0 +1,515 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <conflate.h>
+#include "conflate_internal.h"
+
+#include "test_common.h"
+
+#define SAVE_PATH "check_persist.cfg"
+#define PRIVATE_PATH SAVE_PATH ".private"
+
+static conflate_config_t conf;
+static conflate_handle_t handle;
+/* The save writer outlives a test, so it gets a handle of its own. */
+static conflate_config_t async_conf;
+static conflate_handle_t async_handle;
+static kvpair_t *pair = NULL;
+
+static void quiet_logger(void *userdata, enum conflate_log_level lvl,
+                         const char *msg, ...)
+{
+    (void)userdata;
+    (void)lvl;
+    (void)msg;
+}
+
+static void setup(void) {
+    init_conflate(&conf);
+    conf.log = quiet_logger;
+    memset(&handle, 0, sizeof(handle));
+    handle.conf = &conf;
+    cb_mutex_initialize(&handle.stats_lock);
+    init_private_store(&handle);
+    pair = NULL;
+    remove(SAVE_PATH);
+    remove(PRIVATE_PATH);
+}
+
+static void teardown(void) {
+    free_kvpair(pair);
+    remove(SAVE_PATH);
+    remove(PRIVATE_PATH);
+}
+
+/* A fresh handle, as a restarted process would have. */
+static conflate_handle_t *reopen(conflate_handle_t *h) {
+    memset(h, 0, sizeof(*h));
+    h->conf = &conf;
+    cb_mutex_initialize(&h->stats_lock);
+    init_private_store(h);
+    return h;
+}
+
+static void check_private(conflate_handle_t *h, const char *k,
+                          const char *expected)
+{
+    char *v = conflate_get_private(h, k, SAVE_PATH);
+    if (expected == NULL) {
+        fail_unless(v == NULL, "Found a deleted private value.");
+    } else {
+        fail_if(v == NULL, "Missing private value.");
+        fail_unless(strcmp(v, expected) == 0, "Wrong private value.");
+    }
+    free(v);
+}
+
+static kvpair_t *mk_test_pairs(void) {
+    char *args1[] = {"arg1", "arg2", NULL};
+    char *args2[] = {"", NULL};
+    kvpair_t *rv = mk_kvpair("some_key", args1);
+    rv->next = mk_kvpair("empty_value", args2);
+    rv->next->next = mk_kvpair("no_values", NULL);
+    return rv;
+}
+
+static void corrupt_byte(long offset)
+{
+    FILE *fp = fopen(SAVE_PATH, "r+b");
+    int c;
+    fail_if(fp == NULL, "Couldn't open the saved config.");
+    fseek(fp, offset, SEEK_SET);
+    c = fgetc(fp);
+    fseek(fp, offset, SEEK_SET);
+    fputc(c ^ 0x01, fp);
+    fclose(fp);
+}
+
+static void test_load_missing(void)
+{
+    fail_unless(load_kvpairs(&handle, SAVE_PATH) == NULL,
+                "Loaded a config that was never saved.");
+}
+
+static void test_round_trip(void)
+{
+    kvpair_t *loaded;
+
+    pair = mk_test_pairs();
+    fail_unless(save_kvpairs(&handle, pair, SAVE_PATH), "Save failed.");
+
+    loaded = load_kvpairs(&handle, SAVE_PATH);
+    fail_if(loaded == NULL, "Load failed.");
+    check_pair_equality(pair, loaded);
+    free_kvpair(loaded);
+}
+
+static void test_round_trip_fsync(void)
+{
+    kvpair_t *loaded;
+
+    conf.fsync_saves = true;
+    pair = mk_test_pairs();
+    fail_unless(save_kvpairs(&handle, pair, SAVE_PATH), "Save failed.");
+
+    loaded = load_kvpairs(&handle, SAVE_PATH);
+    fail_if(loaded == NULL, "Load failed.");
+    check_pair_equality(pair, loaded);
+    free_kvpair(loaded);
+}
+
+static void test_overwrite(void)
+{
+    char *args[] = {"newer", NULL};
+    kvpair_t *loaded;
+
+    pair = mk_test_pairs();
+    fail_unless(save_kvpairs(&handle, pair, SAVE_PATH), "Save failed.");
+    free_kvpair(pair);
+
+    pair = mk_kvpair("some_key", args);
+    fail_unless(save_kvpairs(&handle, pair, SAVE_PATH), "Resave failed.");
+
+    loaded = load_kvpairs(&handle, SAVE_PATH);
+    fail_if(loaded == NULL, "Load failed.");
+    check_pair_equality(pair, loaded);
+    free_kvpair(loaded);
+}
+
+static void test_reject_corrupt_payload(void)
+{
+    pair = mk_test_pairs();
+    fail_unless(save_kvpairs(&handle, pair, SAVE_PATH), "Save failed.");
+
+    corrupt_byte(40);
+    fail_unless(load_kvpairs(&handle, SAVE_PATH) == NULL,
+                "Loaded a corrupt config.");
+}
+
+static void test_reject_bad_magic(void)
+{
+    pair = mk_test_pairs();
+    fail_unless(save_kvpairs(&handle, pair, SAVE_PATH), "Save failed.");
+
+    corrupt_byte(0);
+    fail_unless(load_kvpairs(&handle, SAVE_PATH) == NULL,
+                "Loaded a file with the wrong magic.");
+}
+
+static void test_reject_truncated(void)
+{
+    unsigned char *buf;
+    size_t size;
+
+    pair = mk_test_pairs();
+    buf = encode_kvpairs(pair, &size);
+    fail_unless(decode_kvpairs(buf, size - 1) == NULL,
+                "Decoded a truncated config.");
+    fail_unless(decode_kvpairs(buf, 10) == NULL,
+                "Decoded a truncated header.");
+    free(buf);
+}
+
+static void test_mapped_round_trip(void)
+{
+    kvpair_t *loaded;
+    kvpair_t *copy;
+
+    pair = mk_test_pairs();
+    fail_unless(save_kvpairs(&handle, pair, SAVE_PATH), "Save failed.");
+
+    loaded = load_kvpairs_mapped(&handle, SAVE_PATH);
+    fail_if(loaded == NULL, "Mapped load failed.");
+    check_pair_equality(pair, loaded);
+
+    /* The mapping must outlive the file and copies of the view must
+       not point into it. */
+    remove(SAVE_PATH);
+    copy = dup_kvpair(loaded);
+    fail_unless(kvpair_retain(loaded) == loaded, "View wasn't a snapshot.");
+    kvpair_release(loaded);
+    free_kvpair(loaded);
+    check_pair_equality(pair, copy);
+    free_kvpair(copy);
+}
+
+static void test_mapped_values_writable(void)
+{
+    kvpair_t *loaded;
+
+    pair = mk_test_pairs();
+    fail_unless(save_kvpairs(&handle, pair, SAVE_PATH), "Save failed.");
+
+    /* Editing a value in place is fine with mk_kvpair configs. */
+    loaded = load_kvpairs_mapped(&handle, SAVE_PATH);
+    fail_if(loaded == NULL, "Mapped load failed.");
+    loaded->values[0][0] = '!';
+    free_kvpair(loaded);
+
+    loaded = load_kvpairs_mapped(&handle, SAVE_PATH);
+    fail_if(loaded == NULL, "Mapped load failed.");
+    check_pair_equality(pair, loaded);
+    free_kvpair(loaded);
+}
+
+static void test_mapped_load_missing(void)
+{
+    fail_unless(load_kvpairs_mapped(&handle, SAVE_PATH) == NULL,
+                "Mapped a config that was never saved.");
+}
+
+static void test_mapped_reject_bad_offset(void)
+{
+    pair = mk_test_pairs();
+    fail_unless(save_kvpairs(&handle, pair, SAVE_PATH), "Save failed.");
+
+    /* The high byte of the first key's offset. */
+    corrupt_byte(35);
+    fail_unless(load_kvpairs_mapped(&handle, SAVE_PATH) == NULL,
+                "Mapped a config with an offset out of the file.");
+}
+
+static void test_mapped_reject_corrupt_payload(void)
+{
+    struct stat st;
+
+    pair = mk_test_pairs();
+    fail_unless(save_kvpairs(&handle, pair, SAVE_PATH), "Save failed.");
+
+    /* The tables are intact, only the last string changed. */
+    fail_unless(stat(SAVE_PATH, &st) == 0, "Can't stat the saved config.");
+    corrupt_byte(st.st_size - 2);
+    fail_unless(load_kvpairs_mapped(&handle, SAVE_PATH) == NULL,
+                "Mapped a corrupt config.");
+}
+
+static void test_mapped_reject_truncated(void)
+{
+    unsigned char *buf;
+    size_t size;
+    FILE *fp;
+
+    pair = mk_test_pairs();
+    buf = encode_kvpairs(pair, &size);
+    fp = fopen(SAVE_PATH, "wb");
+    fail_if(fp == NULL, "Couldn't write the saved config.");
+    fail_unless(fwrite(buf, 1, size - 1, fp) == size - 1, "Short write.");
+    fclose(fp);
+    free(buf);
+
+    fail_unless(load_kvpairs_mapped(&handle, SAVE_PATH) == NULL,
+                "Mapped a truncated config.");
+}
+
+static void test_private_round_trip(void)
+{
+    check_private(&handle, "k", NULL);
+
+    fail_unless(conflate_save_private(&handle, "k", "v1", SAVE_PATH),
+                "Save failed.");
+    check_private(&handle, "k", "v1");
+    fail_unless(conflate_save_private(&handle, "k", "v2", SAVE_PATH),
+                "Overwrite failed.");
+    check_private(&handle, "k", "v2");
+
+    fail_unless(conflate_delete_private(&handle, "k", SAVE_PATH),
+                "Delete failed.");
+    check_private(&handle, "k", NULL);
+    fail_unless(conflate_delete_private(&handle, "k", SAVE_PATH),
+                "Deleting a missing key failed.");
+}
+
+static void test_private_reload(void)
+{
+    conflate_handle_t other;
+    int i;
+
+    for (i = 0; i < 100; i++) {
+        char key[16];
+        snprintf(key, sizeof(key), "key%d", i);
+        fail_unless(conflate_save_private(&handle, key, key, SAVE_PATH),
+                    "Save failed.");
+    }
+    fail_unless(conflate_save_private(&handle, "empty", "", SAVE_PATH),
+                "Save failed.");
+    fail_unless(conflate_delete_private(&handle, "key7", SAVE_PATH),
+                "Delete failed.");
+
+    reopen(&other);
+    check_private(&other, "key0", "key0");
+    check_private(&other, "key99", "key99");
+    check_private(&other, "key7", NULL);
+    check_private(&other, "empty", "");
+}
+
+static void test_private_torn_append(void)
+{
+    conflate_handle_t other;
+    FILE *fp;
+
+    fail_unless(conflate_save_private(&handle, "a", "1", SAVE_PATH),
+                "Save failed.");
+    fail_unless(conflate_save_private(&handle, "b", "2", SAVE_PATH),
+                "Save failed.");
+
+    /* Half of a record. */
+    fp = fopen(PRIVATE_PATH, "ab");
+    fail_if(fp == NULL, "Couldn't open the log.");
+    fwrite("\x01\x02\x03\x04\x05\x06\x07\x08\x01", 1, 9, fp);
+    fclose(fp);
+
+    reopen(&other);
+    check_private(&other, "a", "1");
+    check_private(&other, "b", "2");
+    fail_unless(conflate_save_private(&other, "c", "3", SAVE_PATH),
+                "Save after a torn append failed.");
+
+    reopen(&other);
+    check_private(&other, "a", "1");
+    check_private(&other, "c", "3");
+}
+
+static void test_private_compaction(void)
+{
+    conflate_handle_t other;
+    char value[128];
+    FILE *fp;
+    long size;
+    int i;
+
+    memset(value, 'x', sizeof(value) - 1);
+    value[sizeof(value) - 1] = '\0';
+    for (i = 0; i < 10000; i++) {
+        value[0] = 'a' + i % 26;
+        fail_unless(conflate_save_private(&handle, "k", value, SAVE_PATH),
+                    "Save failed.");
+    }
+
+    fp = fopen(PRIVATE_PATH, "rb");
+    fail_if(fp == NULL, "Couldn't open the log.");
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fclose(fp);
+    fail_unless(size < 200000, "The log wasn't compacted.");
+
+    reopen(&other);
+    check_private(&other, "k", value);
+}
+
+static void test_save_counters(void)
+{
+    conflate_stats_t stats;
+
+    conf.fsync_saves = true;
+    pair = mk_test_pairs();
+    fail_unless(save_kvpairs(&handle, pair, SAVE_PATH), "Save failed.");
+    fail_unless(conflate_save_private(&handle, "k", "v", SAVE_PATH),
+                "Private save failed.");
+
+    conflate_get_stats(&handle, &stats);
+    fail_unless(stats.saves_written >= 2, "Saves weren't counted.");
+    fail_unless(stats.saves_failed == 0, "Saves failed.");
+    fail_unless(stats.save_fsync_ns > 0, "fsync time wasn't counted.");
+    fail_unless(stats.save_fsync_max_ns <= stats.save_fsync_ns,
+                "Worst fsync time is off.");
+    fail_unless(stats.save_write_ns > 0, "Write time wasn't counted.");
+}
+
+static conflate_handle_t *get_async_handle(void) {
+    if (!async_handle.saves_started) {
+        init_conflate(&async_conf);
+        async_conf.log = quiet_logger;
+        async_conf.async_saves = true;
+        async_handle.conf = &async_conf;
+        cb_mutex_initialize(&async_handle.stats_lock);
+        init_private_store(&async_handle);
+        fail_unless(start_save_writer(&async_handle),
+                    "Couldn't start the save writer.");
+    }
+    return &async_handle;
+}
+
+static void test_async_saves(void)
+{
+    conflate_handle_t *h = get_async_handle();
+    conflate_stats_t before, after;
+    char *args[2];
+    char value[16];
+    kvpair_t *loaded;
+    int i;
+
+    conflate_get_stats(h, &before);
+    args[1] = NULL;
+    for (i = 0; i < 100; i++) {
+        snprintf(value, sizeof(value), "%d", i);
+        args[0] = value;
+        free_kvpair(pair);
+        pair = mk_kvpair("some_key", args);
+        fail_unless(save_kvpairs(h, pair, SAVE_PATH), "Save failed.");
+    }
+    conflate_flush_saves(h);
+    conflate_get_stats(h, &after);
+
+    loaded = load_kvpairs(h, SAVE_PATH);
+    fail_if(loaded == NULL, "Load after a flush failed.");
+    check_pair_equality(pair, loaded);
+    free_kvpair(loaded);
+
+    fail_unless(after.saves_written - before.saves_written +
+                after.saves_coalesced - before.saves_coalesced == 100,
+                "Saves went missing.");
+}
+
+static void test_async_private(void)
+{
+    conflate_handle_t *h = get_async_handle();
+    conflate_handle_t other;
+    char key[16];
+    int i;
+
+    /* A store left over from an earlier test is for a deleted file. */
+    h->private_store = NULL;
+    for (i = 0; i < 100; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        fail_unless(conflate_save_private(h, key, key, SAVE_PATH),
+                    "Save failed.");
+    }
+    fail_unless(conflate_delete_private(h, "key7", SAVE_PATH),
+                "Delete failed.");
+    conflate_flush_saves(h);
+
+    reopen(&other);
+    check_private(&other, "key0", "key0");
+    check_private(&other, "key99", "key99");
+    check_private(&other, "key7", NULL);
+}
+
+static void test_async_private_failed_append(void)
+{
+    conflate_handle_t *h = get_async_handle();
+    conflate_handle_t other;
+
+    h->private_store = NULL;
+    fail_unless(conflate_save_private(h, "a", "1", SAVE_PATH), "Save failed.");
+    fail_unless(conflate_save_private(h, "b", "2", SAVE_PATH), "Save failed.");
+    conflate_flush_saves(h);
+
+    /* Make the writer's next append fail. */
+    fail_unless(remove(PRIVATE_PATH) == 0, "Couldn't remove the log.");
+    fail_unless(mkdir(PRIVATE_PATH, 0755) == 0, "Couldn't block the log.");
+    fail_unless(conflate_save_private(h, "x", "9", SAVE_PATH),
+                "Queued save failed.");
+    conflate_flush_saves(h);
+    fail_unless(rmdir(PRIVATE_PATH) == 0, "Couldn't unblock the log.");
+
+    /* The next change mustn't be appended to what's left. */
+    fail_unless(conflate_save_private(h, "c", "3", SAVE_PATH), "Save failed.");
+    conflate_flush_saves(h);
+
+    reopen(&other);
+    check_private(&other, "a", "1");
+    check_private(&other, "b", "2");
+    check_private(&other, "x", "9");
+    check_private(&other, "c", "3");
+}
+
+int main(void)
+{
+    typedef void (*testcase)(void);
+    testcase tc[] = {
+        test_load_missing,
+        test_round_trip,
+        test_round_trip_fsync,
+        test_overwrite,
+        test_reject_corrupt_payload,
+        test_reject_bad_magic,
+        test_reject_truncated,
+        test_mapped_round_trip,
+        test_mapped_values_writable,
+        test_mapped_load_missing,
+        test_mapped_reject_bad_offset,
+        test_mapped_reject_corrupt_payload,
+        test_mapped_reject_truncated,
+        test_private_round_trip,
+        test_private_reload,
+        test_private_torn_append,
+        test_private_compaction,
+        test_save_counters,
+        test_async_saves,
+        test_async_private,
+        test_async_private_failed_append,
+        NULL
+    };
+    int ii = 0;
+
+    while (tc[ii] != 0) {
+        setup();
+        tc[ii++]();
+        teardown();
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,431 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include <conflate.h>
+#include "conflate_internal.h"
+
+#include "test_common.h"
+
+#define MS ((hrtime_t) 1000000)
+
+static struct config_scanner scanner;
+static conflate_config_t conf;
+static conflate_handle_t handle;
+static struct rest_stream stream;
+static char received[1024];
+static int configs;
+
+static conflate_result new_config(void *userdata, kvpair_t *config)
+{
+    (void)userdata;
+    configs++;
+    strncat(received, get_simple_kvpair_val(config, CONFIG_KEY),
+            sizeof(received) - strlen(received) - 1);
+    strncat(received, "|", sizeof(received) - strlen(received) - 1);
+    return CONFLATE_SUCCESS;
+}
+
+static void setup(void) {
+    init_config_scanner(&scanner);
+    init_conflate(&conf);
+    conf.new_config = new_config;
+    memset(&handle, 0, sizeof(handle));
+    handle.conf = &conf;
+    handle.retry_seed = 42;
+    cb_mutex_initialize(&handle.stats_lock);
+    init_config_delivery(&handle);
+    init_config_slot(&handle);
+    init_config_history(&handle);
+    init_stream(&stream, &handle);
+    stream.url = "http://test/";
+    received[0] = '\0';
+    configs = 0;
+}
+
+static void teardown(void) {
+    destroy_stream(&stream);
+}
+
+static void test_no_delimiter(void)
+{
+    size_t consumed = 0;
+    const char *data = "{\"some\": \"config\"}\n\n";
+
+    fail_if(scan_for_end_of_config(&scanner, data, strlen(data), &consumed),
+            "Found a delimiter that isn't there.");
+    fail_unless(consumed == strlen(data), "Didn't consume the whole chunk.");
+}
+
+static void test_delimiter_at_end(void)
+{
+    size_t consumed = 0;
+    const char *data = "{}\n\n\n\n";
+
+    fail_unless(scan_for_end_of_config(&scanner, data, strlen(data), &consumed),
+                "Didn't find the delimiter.");
+    fail_unless(consumed == strlen(data), "Wrong delimiter position.");
+}
+
+static void test_delimiter_split_across_chunks(void)
+{
+    size_t consumed = 0;
+    const char *first = "{\"a\": 1}\n\n";
+    const char *second = "\n\n{\"b\"";
+
+    fail_if(scan_for_end_of_config(&scanner, first, strlen(first), &consumed),
+            "Found a delimiter in the first half.");
+    fail_unless(consumed == strlen(first), "Didn't consume the first half.");
+
+    fail_unless(scan_for_end_of_config(&scanner, second, strlen(second),
+                                       &consumed),
+                "Didn't complete the split delimiter.");
+    fail_unless(consumed == 2, "Wrong split delimiter position.");
+}
+
+static void test_delimiter_one_byte_at_a_time(void)
+{
+    const char *data = "x\n\n\n\n";
+    size_t i, consumed = 0;
+    int found = 0;
+
+    for (i = 0; i < strlen(data); i++) {
+        if (scan_for_end_of_config(&scanner, &data[i], 1, &consumed)) {
+            found++;
+            fail_unless(i == strlen(data) - 1, "Found the delimiter early.");
+        }
+        fail_unless(consumed == 1, "Didn't consume the byte.");
+    }
+    fail_unless(found == 1, "Didn't find exactly one delimiter.");
+}
+
+static void test_multiple_configs_in_one_chunk(void)
+{
+    const char *data = "{1}\n\n\n\n{2}\n\n\n\n{3}\n\n\n\n{4";
+    const char *ptr = data;
+    size_t remaining = strlen(data);
+    int found = 0;
+
+    while (remaining > 0) {
+        size_t consumed = 0;
+        if (scan_for_end_of_config(&scanner, ptr, remaining, &consumed)) {
+            found++;
+            fail_unless(consumed == 7, "Wrong config size.");
+        }
+        ptr += consumed;
+        remaining -= consumed;
+    }
+    fail_unless(found == 3, "Didn't find three configs.");
+}
+
+static void test_long_newline_run(void)
+{
+    size_t consumed = 0;
+    const char *data = "{}\n\n\n\n\n\n";
+
+    fail_unless(scan_for_end_of_config(&scanner, data, strlen(data), &consumed),
+                "Didn't find the delimiter.");
+    fail_unless(consumed == 6, "Delimiter should end at the fourth newline.");
+    fail_if(scan_for_end_of_config(&scanner, data + consumed,
+                                   strlen(data) - consumed, &consumed),
+            "Leftover newlines shouldn't form a delimiter.");
+}
+
+static void test_unix_socket_url(void)
+{
+    char *socket_path = NULL;
+    char *http_url = NULL;
+
+    fail_unless(parse_unix_socket_url("http+unix://%2Ftmp%2Fagent.sock/pools/x",
+                                      &socket_path, &http_url),
+                "Didn't recognize a unix socket URL.");
+    fail_unless(strcmp(socket_path, "/tmp/agent.sock") == 0,
+                "Wrong socket path.");
+    fail_unless(strcmp(http_url, "http://localhost/pools/x") == 0,
+                "Wrong request URL.");
+    free(socket_path);
+    free(http_url);
+
+    fail_unless(parse_unix_socket_url("http+unix://%2fs", &socket_path,
+                                      &http_url),
+                "Didn't recognize a unix socket URL without a path.");
+    fail_unless(strcmp(socket_path, "/s") == 0, "Wrong socket path.");
+    fail_unless(strcmp(http_url, "http://localhost/") == 0,
+                "Wrong request URL.");
+    free(socket_path);
+    free(http_url);
+
+    fail_if(parse_unix_socket_url("http://localhost/pools", &socket_path,
+                                  &http_url),
+            "Took a plain URL for a unix socket URL.");
+    fail_if(parse_unix_socket_url("http+unix:///pools", &socket_path,
+                                  &http_url),
+            "Took a URL without a socket path.");
+}
+
+static void test_retry_delay_growth(void)
+{
+    hrtime_t expected[] = { 100, 200, 400, 800, 1000, 1000 };
+    size_t i;
+
+    conf.retry_initial_ms = 100;
+    conf.retry_max_ms = 1000;
+    conf.retry_jitter_pct = 0;
+
+    for (i = 0; i < sizeof(expected) / sizeof(expected[0]); i++) {
+        fail_unless(rest_retry_delay(&handle, false) == expected[i] * MS,
+                    "Wrong delay after a failed pass.");
+    }
+    fail_unless(rest_retry_delay(&handle, true) == 100 * MS,
+                "A success didn't reset the delay.");
+    fail_unless(rest_retry_delay(&handle, false) == 100 * MS,
+                "Backoff didn't restart after a success.");
+}
+
+static void test_retry_delay_jitter(void)
+{
+    hrtime_t nominal = 1000;
+    hrtime_t lowest = 0, highest = 0;
+    int i;
+
+    conf.retry_initial_ms = 1000;
+    conf.retry_max_ms = 1000;
+    conf.retry_jitter_pct = 20;
+
+    for (i = 0; i < 1000; i++) {
+        hrtime_t delay = rest_retry_delay(&handle, false);
+        fail_unless(delay <= nominal * MS, "Jitter made the delay longer.");
+        fail_unless(delay >= nominal * MS * 80 / 100,
+                    "Jitter took off more than retry_jitter_pct.");
+        if (i == 0 || delay < lowest) {
+            lowest = delay;
+        }
+        if (delay > highest) {
+            highest = delay;
+        }
+    }
+    fail_unless(highest - lowest > nominal * MS / 10,
+                "Delays weren't spread out.");
+}
+
+static void test_retry_delay_after_broken_stream(void)
+{
+    int i, start_configs;
+
+    conf.retry_initial_ms = 100;
+    conf.retry_max_ms = 1000;
+    conf.retry_jitter_pct = 0;
+
+    start_configs = handle.tot_process_new_configs;
+    for (i = 0; i < 10; i++) {
+        (void) rest_round_delay(&handle, false, start_configs);
+    }
+    fail_unless(rest_round_delay(&handle, false, start_configs) == 1000 * MS,
+                "Failed passes didn't back off.");
+
+    /* A stream delivered a config, then broke. */
+    start_configs = handle.tot_process_new_configs;
+    handle.tot_process_new_configs++;
+    fail_unless(rest_round_delay(&handle, false, start_configs) == 100 * MS,
+                "A stream that delivered didn't reset the backoff.");
+
+    start_configs = handle.tot_process_new_configs;
+    fail_unless(rest_round_delay(&handle, false, start_configs) == 100 * MS,
+                "Backoff didn't restart after the stream broke.");
+    fail_unless(rest_round_delay(&handle, false, start_configs) == 200 * MS,
+                "Backoff didn't grow again.");
+}
+
+static void test_retry_delay_minimum(void)
+{
+    int i;
+
+    conf.retry_initial_ms = 0;
+    conf.retry_max_ms = 0;
+    conf.retry_jitter_pct = 100;
+
+    for (i = 0; i < 100; i++) {
+        fail_unless(rest_retry_delay(&handle, i % 2 == 0) >= MS,
+                    "Retries would spin without a delay.");
+    }
+}
+
+/* A polled response: body bytes and the ETag it came with. */
+static conflate_result poll_response(struct rest_url *url, long code,
+                                     const char *body, const char *etag)
+{
+    reset_stream(&stream);
+    if (body != NULL) {
+        fail_unless(handle_response((void *) body, 1, strlen(body),
+                                    &stream) == strlen(body),
+                    "Body rejected.");
+    }
+    stream.etag = safe_strdup(etag);
+    return finish_rest_response(&stream, url, code);
+}
+
+static void test_poll_not_modified(void)
+{
+    struct rest_url url;
+    conflate_stats_t stats;
+
+    memset(&url, 0, sizeof(url));
+    conf.poll_interval_ms = 1000;
+
+    fail_unless(poll_response(&url, 200, "{\"rev\":1}", "\"a\"") ==
+                CONFLATE_SUCCESS, "First poll failed.");
+    fail_unless(configs == 1, "First poll didn't deliver.");
+    fail_unless(strcmp(url.etag, "\"a\"") == 0, "ETag not kept.");
+
+    fail_unless(poll_response(&url, 304, NULL, "\"a\"") == CONFLATE_SUCCESS,
+                "Not modified poll failed.");
+    fail_unless(configs == 1, "A 304 delivered a config.");
+    fail_unless(strcmp(url.etag, "\"a\"") == 0, "A 304 changed the ETag.");
+    conflate_get_stats(&handle, &stats);
+    fail_unless(stats.configs_not_modified == 1, "The 304 wasn't counted.");
+
+    fail_unless(poll_response(&url, 200, "{\"rev\":2}", "\"b\"") ==
+                CONFLATE_SUCCESS, "Changed poll failed.");
+    fail_unless(configs == 2, "A changed config wasn't delivered.");
+    fail_unless(strcmp(received, "{\"rev\":1}|{\"rev\":2}|") == 0,
+                "Delivered the wrong configs.");
+    fail_unless(strcmp(url.etag, "\"b\"") == 0, "A 200 didn't replace the ETag.");
+
+    free(url.etag);
+    free(url.last_modified);
+}
+
+#ifdef HAVE_ZLIB
+#define TWO_CONFIGS "{\"rev\":1}" END_OF_CONFIG "{\"rev\":2}" END_OF_CONFIG
+
+/* Compress data with the given deflateInit2() window bits: 15 + 16 for
+   gzip, 15 for zlib and -15 for raw deflate framing. */
+static unsigned char *compress_body(const char *data, int window_bits,
+                                    size_t *size)
+{
+    z_stream z;
+    unsigned char *out = malloc(1024);
+
+    memset(&z, 0, sizeof(z));
+    fail_unless(deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, window_bits,
+                             8, Z_DEFAULT_STRATEGY) == Z_OK,
+                "Can't set up deflate.");
+    z.next_in = (Bytef *) data;
+    z.avail_in = (uInt) strlen(data);
+    z.next_out = out;
+    z.avail_out = 1024;
+    fail_unless(deflate(&z, Z_FINISH) == Z_STREAM_END, "Can't deflate.");
+    *size = z.total_out;
+    deflateEnd(&z);
+    return out;
+}
+
+/* Feed a compressed body to a fresh stream, first_chunk bytes in the
+   first write callback and chunk bytes in each one after that. */
+static void feed_compressed(const unsigned char *body, size_t size,
+                            size_t first_chunk, size_t chunk)
+{
+    size_t offset = 0;
+
+    reset_stream(&stream);
+    received[0] = '\0';
+    configs = 0;
+    fail_unless(start_inflate(&stream), "Can't start inflating.");
+
+    while (offset < size) {
+        size_t n = offset == 0 ? first_chunk : chunk;
+        if (n > size - offset) {
+            n = size - offset;
+        }
+        fail_unless(handle_response((void *) (body + offset), 1, n,
+                                    &stream) == n,
+                    "Compressed chunk rejected.");
+        offset += n;
+    }
+}
+
+static void check_compressed_splits(int window_bits)
+{
+    size_t first[] = { 1, 1, 2, 3, 1024 };
+    size_t rest[] = { 1, 7, 1, 5, 1024 };
+    size_t size, i;
+    unsigned char *body = compress_body(TWO_CONFIGS, window_bits, &size);
+
+    for (i = 0; i < sizeof(first) / sizeof(first[0]); i++) {
+        feed_compressed(body, size, first[i], rest[i]);
+        fail_unless(configs == 2, "Didn't find both compressed configs.");
+        fail_unless(strcmp(received, "{\"rev\":1}" END_OF_CONFIG "|"
+                           "{\"rev\":2}" END_OF_CONFIG "|") == 0,
+                    "Compressed configs came out wrong.");
+    }
+    free(body);
+}
+
+static void test_gzip_body(void)
+{
+    check_compressed_splits(MAX_WBITS + 16);
+}
+
+static void test_zlib_body(void)
+{
+    check_compressed_splits(MAX_WBITS);
+}
+
+static void test_raw_deflate_body(void)
+{
+    check_compressed_splits(-MAX_WBITS);
+}
+
+static void test_corrupt_compressed_body(void)
+{
+    size_t size;
+    unsigned char *body = compress_body(TWO_CONFIGS, MAX_WBITS + 16, &size);
+
+    fail_unless(start_inflate(&stream), "Can't start inflating.");
+    fail_unless(handle_response(body, 1, 10, &stream) == 10,
+                "gzip header rejected.");
+    memset(body + 10, 0xff, size - 10);
+    fail_unless(handle_response(body + 10, 1, size - 10, &stream) == 0,
+                "Corrupt compressed data accepted.");
+    fail_unless(configs == 0, "Delivered a corrupt config.");
+    free(body);
+}
+#endif
+
+int main(void)
+{
+    typedef void (*testcase)(void);
+    testcase tc[] = {
+        test_no_delimiter,
+        test_delimiter_at_end,
+        test_delimiter_split_across_chunks,
+        test_delimiter_one_byte_at_a_time,
+        test_multiple_configs_in_one_chunk,
+        test_long_newline_run,
+        test_unix_socket_url,
+        test_retry_delay_growth,
+        test_retry_delay_jitter,
+        test_retry_delay_after_broken_stream,
+        test_retry_delay_minimum,
+        test_poll_not_modified,
+#ifdef HAVE_ZLIB
+        test_gzip_body,
+        test_zlib_body,
+        test_raw_deflate_body,
+        test_corrupt_compressed_body,
+#endif
+        NULL
+    };
+    int ii = 0;
+
+    while (tc[ii] != 0) {
+        setup();
+        tc[ii++]();
+        teardown();
+    }
+
+    return EXIT_SUCCESS;
+}
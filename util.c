@@ -3,7 +3,21 @@
 #include <assert.h>
 #include <string.h>
 
+#ifdef WIN32
+#include <windows.h>
+#define compare_and_swap(p, old, new) \
+    (InterlockedCompareExchange(p, new, old) == (old))
+#define yield_thread() Sleep(0)
+#define memory_barrier() MemoryBarrier()
+#else
+#include <sched.h>
+#define compare_and_swap(p, old, new) __sync_bool_compare_and_swap(p, old, new)
+#define yield_thread() sched_yield()
+#define memory_barrier() __sync_synchronize()
+#endif
+
 #include "conflate.h"
+#include "conflate_internal.h"
 
 char* safe_strdup(const char* in) {
     int len = strlen(in);
@@ -21,3 +35,36 @@ void free_string_list(char **vals)
     }
     free(vals);
 }
+
+uint64_t conflate_hash(const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint64_t h = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+
+    return h;
+}
+
+void conflate_once(volatile long *once, void (*init)(void))
+{
+    if (*once == CONFLATE_ONCE_DONE) {
+        memory_barrier();
+        return;
+    }
+    if (compare_and_swap(once, CONFLATE_ONCE_INIT, CONFLATE_ONCE_RUNNING)) {
+        init();
+        memory_barrier();
+        *once = CONFLATE_ONCE_DONE;
+        return;
+    }
+    /* Somebody else got there first; it doesn't take long. */
+    while (*once != CONFLATE_ONCE_DONE) {
+        yield_thread();
+    }
+    memory_barrier();
+}